@@ -1,32 +1,16 @@
 #include <math.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
-#include <lv2/lv2plug.in/ns/lv2core/lv2.h>
-#include <lv2/lv2plug.in/ns/ext/atom/atom.h>
-#include <lv2/lv2plug.in/ns/ext/atom/forge.h>
-#include <lv2/lv2plug.in/ns/ext/log/logger.h>
-#include <lv2/lv2plug.in/ns/ext/midi/midi.h>
-#include "lv2/lv2plug.in/ns/ext/time/time.h"
-#include <lv2/lv2plug.in/ns/ext/urid/urid.h>
-
-#ifndef DEBUG
-#define DEBUG 0
-#endif
-#define debug_print(...) \
-    ((void)((DEBUG) ? fprintf(stderr, __VA_ARGS__) : 0))
-
-#define NUM_VOICES 16
-#define PLUGIN_URI "http://bramgiesen.com/arpeggiator"
-
+#include "bg-core.h"
 
-// Struct for a 3 byte MIDI event
-typedef struct {
-    LV2_Atom_Event event;
-    uint8_t        msg[3];
-} LV2_Atom_MIDI;
+#define MAX_OCTAVES 4
+#define TICKS_PER_BEAT 960
+// Longest step program: an up-down note sequence over all keys combined
+// with an up-down octave sequence
+#define PROGRAM_SIZE (2 * NUM_KEYS * (2 * MAX_OCTAVES - 2))
+#define PLUGIN_URI "http://bramgiesen.com/arpeggiator"
 
 
 typedef enum {
@@ -42,62 +26,110 @@ typedef enum {
     OCTAVESPREAD,
     OCTAVEMODE,
     VELOCITY,
-    BYPASS
+    BYPASS,
+    SEED,
+    METRICS,
+    TRACE
 } PortIndex;
 
 
+// Control port values, read once at the start of every run()
+typedef struct {
+    float     bpm;
+    int       arp_mode;
+    bool      latch;
+    float     divisions;
+    int       sync;
+    float     note_length;
+    int       octave_spread;
+    int       octave_mode;
+    uint8_t   velocity;
+    bool      enabled;
+    uint32_t  seed;
+    bool      trace;
+} ArpParams;
+
+// Groups of parameters that changed since the previous block
+typedef enum {
+    PARAMS_TEMPO   = 1 << 0,
+    PARAMS_PHASE   = 1 << 1,
+    PARAMS_LATCH   = 1 << 2,
+    PARAMS_PATTERN = 1 << 3,
+    PARAMS_SEED    = 1 << 4,
+    PARAMS_ALL     = 0x1F
+} ArpParamsChange;
+
+// Set of held keys: a bitmap for O(1) insert/remove and the sorted order,
+// plus the keys in the order they were played
+typedef struct {
+    uint64_t  keys[2];
+    uint8_t   played[NUM_KEYS];
+    uint8_t   sorted[NUM_KEYS];
+    size_t    count;
+} HeldNotes;
+
+// Pending note off, released at an absolute frame
+typedef struct {
+    uint64_t  frame;
+    uint8_t   note;
+} NoteOff;
+
+// Min-heap of pending note offs ordered by release frame. There is at most
+// one pending note off per key, so the queue can never overflow.
 typedef struct {
-    LV2_URID atom_Blank;
-    LV2_URID atom_Float;
-    LV2_URID atom_Object;
-    LV2_URID atom_Path;
-    LV2_URID atom_Resource;
-    LV2_URID atom_Sequence;
-    LV2_URID time_Position;
-    LV2_URID time_barBeat;
-    LV2_URID time_beatsPerMinute;
-    LV2_URID time_speed;
-} ClockURIs;
+    NoteOff   entries[NUM_KEYS];
+    int       index[NUM_KEYS]; // heap position of each key, -1 if not pending
+    size_t    count;
+} NoteOffQueue;
 
 typedef struct {
-    LV2_URID_Map*          map; // URID map feature
-    LV2_Log_Log* 	       log;
+    HostFeatures          host;
     LV2_Log_Logger      logger; // Logger API
     ClockURIs             uris; // Cache of mapped URIDs
-
-    // URIDs
-    LV2_URID urid_midiEvent;
+    MetricsURIs   metrics_uris;
+    LV2_Atom_Forge       forge;
 
     const LV2_Atom_Sequence* MIDI_in;
     LV2_Atom_Sequence*       MIDI_out;
+    LV2_Atom_Sequence*       metrics_out;
 
-    float     divisions;
+    ArpParams params;
+    bool      params_valid;
     double    samplerate;
-    int       prev_sync;
-    // Variables to keep track of the tempo information sent by the host
-    float     bpm; // Beats per minute (tempo)
-    uint32_t  pos;
-    uint32_t  period;
-    uint32_t  h_wavelength;
-    uint8_t   midi_notes[NUM_VOICES];
-    uint8_t   previous_midinote;
-    uint32_t  noteoff_buffer[NUM_VOICES][2];
-    size_t    active_notes_index;
-    int       note_played;
-    size_t    active_notes;
+    // Tempo information sent by the host, or the tempo of the Bpm control
+    // when not synced
+    Transport transport;
+    // Position inside the current step. The phase counts in units of
+    // 1/(60000 * samplerate) tick and advances by the tempo in milli-BPM
+    // times TICKS_PER_BEAT every frame, so it stays exact for any length
+    // of time and a tempo change does not move it.
+    uint64_t  phase;
+    uint64_t  phase_inc;
+    uint64_t  step_length;
+    uint64_t  units_per_tick;
+    uint32_t  note_off_length;
+    HeldNotes held_notes;
+    // The arpeggio compiled from the held notes, arp mode and octave
+    // settings, rebuilt only when one of those changes
+    uint8_t   program[PROGRAM_SIZE];
+    size_t    program_length;
+    size_t    step_index;
+    bool      program_dirty;
+    // The note sequence the program was built from, so the arpeggio goes on
+    // at the same note when the held notes change. Empty when it starts over.
+    uint8_t   seq_notes[2 * NUM_KEYS];
+    size_t    seq_length;
+    size_t    seq_octaves;
+    uint64_t  random_state; // Per instance generator for the random modes
+    NoteOffQueue noteoff_queue;
+    OutQueue  out_queue;
+    Metrics   metrics;
+    TraceRing trace;
+    uint64_t  frame_count; // Frames processed since activation
     size_t    notes_pressed;
-    int       octave_index;
     bool      triggered;
-    bool      octave_up;
-    bool      arp_up;
     bool      latch_playing;
     bool      first_note;
-    float     speed; // Transport speed (usually 0=stop, 1=play)
-    float     beat_in_measure;
-    float     previous_beat_in_measure;
-    float     previous_latch;
-    float     time_position;
-    int       previous_octave_mode;
 
     float*    cv_gate;
     float*    changeBpm;
@@ -110,210 +142,477 @@ typedef struct {
     float*    octaveModeParam;
     float*    velocity;
     float*    bypass;
+    float*    seed;
+    float*    trace_port;
 } Arpeggiator;
 
 
+static bool
+heldNotesContains(const HeldNotes* notes, uint8_t note)
+{
+    return (notes->keys[note >> 6] >> (note & 63)) & 1;
+}
+
+
+// Read the bitmap back in ascending order
 static void
-swap(uint8_t *a, uint8_t *b)
+heldNotesSort(HeldNotes* notes)
 {
-    int temp = *a;
-    *a = *b;
-    *b = temp;
+    size_t n = 0;
+
+    for (unsigned word = 0; word < 2; word++) {
+        uint64_t bits = notes->keys[word];
+        while (bits) {
+            notes->sorted[n++] = (uint8_t)((word << 6) + __builtin_ctzll(bits));
+            bits &= bits - 1;
+        }
+    }
 }
 
 
-//got the code for the quick sort algorithm here https://medium.com/human-in-a-machine-world/quicksort-the-best-sorting-algorithm-6ab461b5a9d0
 static void
-quicksort(uint8_t arr[], int l, int r)
+heldNotesInsert(HeldNotes* notes, uint8_t note)
 {
-    if (l >= r)
-    {
+    if (note >= NUM_KEYS || heldNotesContains(notes, note)) {
         return;
     }
 
-    int pivot = arr[r];
+    notes->keys[note >> 6] |= (uint64_t)1 << (note & 63);
+    notes->played[notes->count++] = note;
+    heldNotesSort(notes);
+}
 
-    int cnt = l;
 
-    for (int i = l; i <= r; i++)
-    {
-        if (arr[i] <= pivot)
-        {
-            swap(&arr[cnt], &arr[i]);
-            cnt++;
-        }
+static void
+heldNotesRemove(HeldNotes* notes, uint8_t note)
+{
+    if (note >= NUM_KEYS || !heldNotesContains(notes, note)) {
+        return;
     }
-    quicksort(arr, l, cnt-2);
-    quicksort(arr, cnt, r);
+
+    notes->keys[note >> 6] &= ~((uint64_t)1 << (note & 63));
+
+    size_t i = 0;
+    while (notes->played[i] != note) {
+        i++;
+    }
+    memmove(&notes->played[i], &notes->played[i + 1], notes->count - i - 1);
+    notes->count--;
+    heldNotesSort(notes);
 }
 
 
-static uint8_t
-octaveHandler(Arpeggiator* self)
+static void
+heldNotesClear(HeldNotes* notes)
 {
-    uint8_t octave = 0;
+    notes->keys[0] = 0;
+    notes->keys[1] = 0;
+    notes->count = 0;
+}
 
-    int octaveMode = *self->octaveModeParam;
 
-    if (octaveMode != self->previous_octave_mode) {
-        switch (octaveMode)
-        {
-            case 0:
-                self->octave_index = self->note_played % (int)*self->octaveSpreadParam;
-                break;
-            case 1:
-                self->octave_index = self->note_played % (int)*self->octaveSpreadParam;
-                self->octave_index = (int)*self->octaveSpreadParam;
-                break;
-            case 2:
-                self->octave_index = self->note_played % (int)(*self->octaveSpreadParam * 2);
-                if (self->octave_index > (int)*self->octaveSpreadParam) {
-                    self->octave_index = abs((int)*self->octaveSpreadParam - (self->octave_index - (int)*self->octaveSpreadParam)) % (int)*self->octaveSpreadParam;
-                }
-                self->octave_up = !self->octave_up;
-                break;
-            case 3:
-                self->octave_index = (int)*self->octaveSpreadParam;
-                self->octave_up = !self->octave_up;
-                break;
+
+static void
+noteOffQueueSet(NoteOffQueue* queue, size_t i, NoteOff entry)
+{
+    queue->entries[i] = entry;
+    queue->index[entry.note] = (int)i;
+}
+
+
+static void
+noteOffQueueSiftUp(NoteOffQueue* queue, size_t i)
+{
+    NoteOff entry = queue->entries[i];
+
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (queue->entries[parent].frame <= entry.frame) {
+            break;
         }
-        self->previous_octave_mode = octaveMode;
+        noteOffQueueSet(queue, i, queue->entries[parent]);
+        i = parent;
     }
+    noteOffQueueSet(queue, i, entry);
+}
 
-    if (*self->octaveSpreadParam > 1) {
-        switch (octaveMode)
-        {
-            case 0:
-                octave = 12 * self->octave_index;
-                self->octave_index = (self->octave_index + 1) % (int)*self->octaveSpreadParam;
-                break;
-            case 1:
-                octave = 12 * self->octave_index;
-                self->octave_index--;
-                self->octave_index = (self->octave_index < 0) ? (int)*self->octaveSpreadParam - 1 : self->octave_index;
-                break;
-            case 2:
-                octave = 12 * self->octave_index;
-
-                if (self->octave_up) {
-                    self->octave_index++;
-                    self->octave_up = (self->octave_index >= (int)*self->octaveSpreadParam - 1) ? false : true;
-                } else {
-                    self->octave_index--;
-                    self->octave_up = (self->octave_index <= 0) ? true : false;
-                }
-                break;
-            case 3:
-                octave = 12 * self->octave_index;
-                if (!self->octave_up) {
-                    self->octave_index--;
-                    self->octave_up = (self->octave_index <= 0) ? true : false;
-                } else {
-                    self->octave_index = (self->octave_index + 1) % (int)*self->octaveSpreadParam;
-                    self->octave_up = (self->octave_index >= (int)*self->octaveSpreadParam - 1) ? false : true;
-                }
-                break;
+
+static void
+noteOffQueueSiftDown(NoteOffQueue* queue, size_t i)
+{
+    NoteOff entry = queue->entries[i];
+
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= queue->count) {
+            break;
         }
-    } else {
-        self->octave_index = 0;
+        if (child + 1 < queue->count
+                && queue->entries[child + 1].frame < queue->entries[child].frame) {
+            child++;
+        }
+        if (entry.frame <= queue->entries[child].frame) {
+            break;
+        }
+        noteOffQueueSet(queue, i, queue->entries[child]);
+        i = child;
     }
+    noteOffQueueSet(queue, i, entry);
+}
+
 
-    return octave;
+static void
+noteOffQueueClear(NoteOffQueue* queue)
+{
+    queue->count = 0;
+
+    for (unsigned i = 0; i < NUM_KEYS; i++) {
+        queue->index[i] = -1;
+    }
 }
 
 
+static bool
+noteOffQueueContains(const NoteOffQueue* queue, uint8_t note)
+{
+    return queue->index[note] >= 0;
+}
+
 
-static LV2_Atom_MIDI
-createMidiEvent(Arpeggiator* self, uint8_t status, uint8_t note, uint8_t velocity)
+static void
+noteOffQueueRemove(NoteOffQueue* queue, uint8_t note)
 {
-    LV2_Atom_MIDI msg;
-    memset(&msg, 0, sizeof(LV2_Atom_MIDI));
+    size_t i = (size_t)queue->index[note];
 
-    msg.event.body.size = 3;
-    msg.event.body.type = self->urid_midiEvent;
+    queue->index[note] = -1;
+    queue->count--;
+
+    if (i < queue->count) {
+        const NoteOff last = queue->entries[queue->count];
+        noteOffQueueSet(queue, i, last);
+        noteOffQueueSiftDown(queue, i);
+        noteOffQueueSiftUp(queue, (size_t)queue->index[last.note]);
+    }
+}
 
-    msg.msg[0] = status;
-    msg.msg[1] = note;
-    msg.msg[2] = velocity;
 
-    return msg;
+static void
+noteOffQueuePush(NoteOffQueue* queue, uint8_t note, uint64_t frame)
+{
+    NoteOff entry = { frame, note };
+
+    queue->count++;
+    noteOffQueueSet(queue, queue->count - 1, entry);
+    noteOffQueueSiftUp(queue, queue->count - 1);
 }
 
 
+// Seed the random generator, a seed of 0 picks a different sequence for
+// every instance
+static void
+randomSeed(Arpeggiator* self, uint32_t seed)
+{
+    uint64_t z = (seed > 0) ? seed : (uint64_t)(uintptr_t)self;
+
+    // splitmix64, so that nearby seeds give unrelated sequences
+    z += 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+
+    self->random_state = (z != 0) ? z : 1;
+}
+
+
+// xorshift64*, returns a random number below range
+static uint32_t
+randomNext(Arpeggiator* self, uint32_t range)
+{
+    uint64_t x = self->random_state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    self->random_state = x;
+
+    return (uint32_t)((((x * 0x2545F4914F6CDD1DULL) >> 32) * range) >> 32);
+}
 
+
+// Put the program in a new random order for the next cycle of the no repeat
+// random mode, without playing the last note of this cycle twice in a row
 static void
-handleNoteOn(Arpeggiator* self, const uint32_t outCapacity)
+shuffleProgram(Arpeggiator* self)
 {
-    size_t searched_voices = 0;
-    bool   note_found = false;
+    const size_t length = self->program_length;
+    const uint8_t last = (length > 0) ? self->program[length - 1] : 0;
+
+    for (size_t i = length; i > 1; i--) {
+        const size_t j = randomNext(self, (uint32_t)i);
+        const uint8_t note = self->program[i - 1];
+        self->program[i - 1] = self->program[j];
+        self->program[j] = note;
+    }
+    if (length > 1 && self->program[0] == last) {
+        const size_t j = 1 + randomNext(self, (uint32_t)length - 1);
+        self->program[0] = self->program[j];
+        self->program[j] = last;
+    }
+}
+
+
+// The held notes changed while the arpeggio plays. Find the step of the new
+// program that goes on where the old one was, the way the separate note and
+// octave counters of the old step handlers did: the note index stays, but
+// moves on past keys inserted before it, and the octave that was up next
+// comes next.
+static size_t
+followStep(const Arpeggiator* self, const uint8_t* note_seq, size_t n_notes, size_t n_octaves,
+        size_t length)
+{
+    uint64_t old_keys[2] = { 0, 0 };
+    size_t note = self->step_index % self->seq_length;
+    size_t inserted = 0;
+
+    for (size_t i = 0; i < self->seq_length; i++) {
+        old_keys[self->seq_notes[i] >> 6] |= (uint64_t)1 << (self->seq_notes[i] & 63);
+    }
+    for (size_t i = 0; i < n_notes && i < note + inserted; i++) {
+        if (!((old_keys[note_seq[i] >> 6] >> (note_seq[i] & 63)) & 1)) {
+            inserted++;
+        }
+    }
+    note = (note + inserted) % n_notes;
 
-    while (!note_found && searched_voices < NUM_VOICES)
+    const size_t octave = (self->step_index % self->seq_octaves) % n_octaves;
+
+    for (size_t i = note; i < length; i += n_notes) {
+        if (i % n_octaves == octave) {
+            return i;
+        }
+    }
+
+    return note;
+}
+
+
+// Compile the held notes, arp mode and octave mode/spread into the list of
+// pitches the arpeggio steps through. The note and the octave sequence both
+// advance on every step, so the program repeats after the least common
+// multiple of their lengths.
+static void
+buildProgram(Arpeggiator* self)
+{
+    const HeldNotes* notes = &self->held_notes;
+    const ArpParams* params = &self->params;
+    const size_t count = (notes->count < NUM_KEYS) ? notes->count : NUM_KEYS;
+    const int spread = (params->octave_spread < MAX_OCTAVES) ? params->octave_spread : MAX_OCTAVES;
+    uint8_t note_seq[2 * NUM_KEYS];
+    uint8_t octave_seq[2 * MAX_OCTAVES];
+    size_t n_notes = 0;
+    size_t n_octaves = 0;
+
+    // Played mode follows the order the keys came in, the others the pitch
+    const uint8_t* view = (params->arp_mode == 4) ? notes->played : notes->sorted;
+
+    switch (params->arp_mode)
     {
-        self->note_played = (self->note_played < 0) ? 0 : self->note_played;
+        case 1:
+            // Down starts on the lowest note before wrapping to the top
+            for (size_t i = count; i-- > 0;) {
+                note_seq[n_notes++] = view[(i + 1) % count];
+            }
+            break;
+        case 2:
+            for (size_t i = 0; i < count; i++) {
+                note_seq[n_notes++] = view[i];
+            }
+            for (size_t i = count - 1; count >= 3 && --i > 0;) {
+                note_seq[n_notes++] = view[i];
+            }
+            break;
+        case 3:
+            for (size_t i = 0; i < count; i++) {
+                note_seq[n_notes++] = view[i];
+            }
+            for (size_t i = count; i-- > 0;) {
+                note_seq[n_notes++] = view[i];
+            }
+            break;
+        default:
+            for (size_t i = 0; i < count; i++) {
+                note_seq[n_notes++] = view[i];
+            }
+            break;
+    }
 
-        if (self->midi_notes[self->note_played] > 0
-                && self->midi_notes[self->note_played] < 128)
-        {
-            uint8_t octave = octaveHandler(self);
-            uint8_t velocity = (uint8_t)*self->velocity;
-
-            //create MIDI note on message
-            uint8_t midi_note = self->midi_notes[self->note_played] + octave;
-            self->previous_midinote = midi_note;
-
-            LV2_Atom_MIDI onMsg = createMidiEvent(self, 144, midi_note, velocity);
-            lv2_atom_sequence_append_event(self->MIDI_out, outCapacity, (LV2_Atom_Event*)&onMsg);
-            self->noteoff_buffer[self->active_notes_index][0] = (uint32_t)midi_note;
-            self->active_notes_index = (self->active_notes_index + 1) % NUM_VOICES;
-            note_found = true;
+    switch ((spread > 1) ? params->octave_mode : 0)
+    {
+        case 1:
+            // Like the notes, down starts on the lowest octave
+            for (int i = spread; i-- > 0;) {
+                octave_seq[n_octaves++] = 12 * ((i + 1) % spread);
+            }
+            break;
+        case 2:
+        case 3:
+            // Down-up runs through the same cycle as up-down and, starting
+            // on the lowest octave, in the same order
+            for (int i = 0; i < spread; i++) {
+                octave_seq[n_octaves++] = 12 * i;
+            }
+            for (int i = spread - 2; i > 0; i--) {
+                octave_seq[n_octaves++] = 12 * i;
+            }
+            break;
+        default:
+            for (int i = 0; i < spread; i++) {
+                octave_seq[n_octaves++] = 12 * i;
+            }
+            break;
+    }
+
+    size_t length = n_notes;
+
+    while (length % n_octaves != 0) {
+        length += n_notes;
+    }
+
+    // Only the held notes changed, go on where the arpeggio was
+    if (self->seq_length > 0 && n_notes > 0 && params->arp_mode < 5) {
+        self->step_index = followStep(self, note_seq, n_notes, n_octaves, length);
+    }
+    memcpy(self->seq_notes, note_seq, n_notes);
+    self->seq_length = n_notes;
+    self->seq_octaves = n_octaves;
+
+    for (size_t i = 0; i < length; i++) {
+        self->program[i] = note_seq[i % n_notes] + octave_seq[i % n_octaves];
+    }
+    self->program_length = length;
+
+    if (params->arp_mode == 6) {
+        shuffleProgram(self);
+    }
+
+    self->step_index = (self->program_length > 0) ? self->step_index % self->program_length : 0;
+    self->program_dirty = false;
+}
+
+
+
+static bool
+createMidiEvent(Arpeggiator* self, uint32_t frame, uint8_t status, uint8_t note, uint8_t velocity)
+{
+    const uint8_t msg[3] = { status, note, velocity };
+
+    if (!outQueuePush(&self->out_queue, frame, msg, 3)) {
+        return false;
+    }
+    traceWrite(&self->trace, self->frame_count + frame, (status == 144) ? TRACE_NOTE_ON : TRACE_NOTE_OFF,
+            0, note, velocity);
+
+    return true;
+}
+
+
+
+static void
+handleNoteOn(Arpeggiator* self, uint32_t frame)
+{
+    if (self->program_dirty) {
+        buildProgram(self);
+    }
+    if (self->program_length == 0) {
+        return;
+    }
+
+    size_t index = self->step_index;
+
+    if (self->params.arp_mode == 5) {
+        index = randomNext(self, (uint32_t)self->program_length);
+    }
+
+    //create MIDI note on message
+    uint8_t midi_note = self->program[index];
+    uint8_t velocity = self->params.velocity;
+
+    traceWrite(&self->trace, self->frame_count + frame, TRACE_STEP, (uint32_t)index, midi_note, velocity);
+
+    if (self->params.arp_mode != 5) {
+        self->step_index = (index + 1 < self->program_length) ? index + 1 : 0;
+        if (self->step_index == 0 && self->params.arp_mode == 6) {
+            shuffleProgram(self);
         }
-        if (*self->arp_mode == 0 || (*self->arp_mode == 2 && self->active_notes < 3)
-                || *self->arp_mode == 4 ) {
-            self->note_played = (self->note_played + 1) % NUM_VOICES;
-        } else if (*self->arp_mode == 1) {
-            self->note_played--;
-            self->note_played = (self->note_played < 0) ? (int)self->active_notes : self->note_played;
-        } else if (*self->arp_mode == 5) {
-            int active_div = (self->active_notes <= 0) ? 1 : (int)self->active_notes;
-            self->note_played = random() % active_div;
-        } else{
-            if (self->arp_up) {
-                self->note_played++;
-                if (self->note_played >= self->active_notes) {
-                   self->arp_up = false;
-                   if (*self->arp_mode != 3) {
-                       self->note_played = (self->active_notes > 1) ? self->note_played - 2 : self->note_played;
-                   }
-                }
-            } else {
-                self->note_played--;
-                if (*self->arp_mode != 3) {
-                    self->arp_up = (self->note_played <= 0) ? true : false;
-                } else {
-                    self->arp_up = (self->note_played < 0) ? true : false;
-                }
+    }
+
+    if (midi_note < NUM_KEYS) {
+        // Retriggering a key that still sounds, release it first. Without room
+        // for the release the note on would not fit either.
+        if (noteOffQueueContains(&self->noteoff_queue, midi_note)) {
+            if (!createMidiEvent(self, frame, 128, midi_note, 0)) {
+                return;
             }
+            noteOffQueueRemove(&self->noteoff_queue, midi_note);
+        }
+
+        if (createMidiEvent(self, frame, 144, midi_note, velocity)) {
+            self->metrics.steps++;
+            noteOffQueuePush(&self->noteoff_queue, midi_note,
+                    self->frame_count + frame + self->note_off_length);
         }
-        searched_voices++;
     }
 }
 
 
 
+// Send the note offs that are due at this frame. A note off that does not
+// fit in the output stays pending and is sent at a later frame.
 static void
-handleNoteOff(Arpeggiator* self, const uint32_t outCapacity)
-{
-    for (size_t i = 0; i < NUM_VOICES; i++) {
-        if (self->noteoff_buffer[i][0] > 0) {
-            self->noteoff_buffer[i][1] += 1;
-            if (self->noteoff_buffer[i][1] > (uint32_t)(self->period * *self->note_length)) {
-                LV2_Atom_MIDI offMsg = createMidiEvent(self, 128, (uint8_t)self->noteoff_buffer[i][0], 0);
-                lv2_atom_sequence_append_event(self->MIDI_out, outCapacity, (LV2_Atom_Event*)&offMsg);
-                self->noteoff_buffer[i][0] = 0;
-                self->noteoff_buffer[i][1] = 0;
-            }
+handleNoteOff(Arpeggiator* self, uint32_t frame)
+{
+    NoteOffQueue* queue = &self->noteoff_queue;
+    const uint64_t now = self->frame_count + frame;
+
+    while (queue->count > 0 && queue->entries[0].frame <= now) {
+        const uint8_t note = queue->entries[0].note;
+        if (!createMidiEvent(self, frame, 128, note, 0)) {
+            break;
+        }
+        noteOffQueueRemove(queue, note);
+    }
+}
+
+
+// Send all pending note offs now, as far as they fit in the output
+static void
+flushNoteOffs(Arpeggiator* self, uint32_t frame)
+{
+    NoteOffQueue* queue = &self->noteoff_queue;
+
+    while (queue->count > 0) {
+        const uint8_t note = queue->entries[0].note;
+        if (!createMidiEvent(self, frame, 128, note, 0)) {
+            break;
         }
+        noteOffQueueRemove(queue, note);
+    }
+}
+
+
+// Frames until the next pending note off, or max_frames when there is none
+// due earlier
+static uint32_t
+nextNoteOff(Arpeggiator* self, uint32_t frame, uint32_t max_frames)
+{
+    const NoteOffQueue* queue = &self->noteoff_queue;
+    const uint64_t now = self->frame_count + frame;
+
+    if (queue->count > 0 && queue->entries[0].frame - now < max_frames) {
+        return (uint32_t)(queue->entries[0].frame - now);
     }
+
+    return max_frames;
 }
 
 
@@ -364,6 +663,15 @@ connect_port(LV2_Handle instance,
         case BYPASS:
             self->bypass = (float*)data;
             break;
+        case SEED:
+            self->seed = (float*)data;
+            break;
+        case METRICS:
+            self->metrics_out = (LV2_Atom_Sequence*)data;
+            break;
+        case TRACE:
+            self->trace_port = (float*)data;
+            break;
     }
 }
 
@@ -374,9 +682,13 @@ activate(LV2_Handle instance)
 {
     Arpeggiator* self = (Arpeggiator*)instance;
 
-    self->bpm = *self->changeBpm;
-    self->divisions =*self->changedDiv;
-    self->pos = 0;
+    self->params_valid = false;
+    self->phase = 0;
+    self->frame_count = 0;
+    transportReset(&self->transport);
+    noteOffQueueClear(&self->noteoff_queue);
+    outQueueClear(&self->out_queue);
+    memset(&self->metrics, 0, sizeof(Metrics));
 }
 
 
@@ -393,68 +705,38 @@ instantiate(const LV2_Descriptor*     descriptor,
         return NULL;
     }
 
-    for (uint32_t i=0; features[i]; ++i)
-    {
-        if (!strcmp (features[i]->URI, LV2_URID__map))
-        {
-            self->map = (LV2_URID_Map*)features[i]->data;
-        }
-        else if (!strcmp (features[i]->URI, LV2_LOG__log))
-        {
-            self->log = (LV2_Log_Log*)features[i]->data;
-        }
-    }
+    hostFeaturesGet(&self->host, features);
+    lv2_log_logger_init (&self->logger, self->host.map, self->host.log);
 
-    lv2_log_logger_init (&self->logger, self->map, self->log);
-
-    if (!self->map) {
+    if (!self->host.map) {
         lv2_log_error (&self->logger, "arpeggiator.lv2 error: Host does not support urid:map\n");
         free (self);
         return NULL;
     }
 
     // Map URIS
-    ClockURIs* const    uris  = &self->uris;
-    LV2_URID_Map* const map   = self->map;
-    self->urid_midiEvent      = map->map(map->handle, LV2_MIDI__MidiEvent);
-    uris->atom_Blank          = map->map(map->handle, LV2_ATOM__Blank);
-    uris->atom_Float          = map->map(map->handle, LV2_ATOM__Float);
-    uris->atom_Object         = map->map(map->handle, LV2_ATOM__Object);
-    uris->atom_Path           = map->map(map->handle, LV2_ATOM__Path);
-    uris->atom_Resource       = map->map(map->handle, LV2_ATOM__Resource);
-    uris->atom_Sequence       = map->map(map->handle, LV2_ATOM__Sequence);
-    uris->time_Position       = map->map(map->handle, LV2_TIME__Position);
-    uris->time_barBeat        = map->map(map->handle, LV2_TIME__barBeat);
-    uris->time_beatsPerMinute = map->map(map->handle, LV2_TIME__beatsPerMinute);
-    uris->time_speed          = map->map(map->handle, LV2_TIME__speed);
-
-    debug_print("DEBUGING");
+    LV2_URID_Map* const map = self->host.map;
+    clockURIsMap(&self->uris, map);
+    metricsURIsMap(&self->metrics_uris, map, PLUGIN_URI);
+    lv2_atom_forge_init(&self->forge, map);
+
     self->samplerate = rate;
-    self->prev_sync   = 0;
-    self->beat_in_measure = 0.0;
-    self->previous_beat_in_measure = 0.0;
+    self->units_per_tick = 60000 * (uint64_t)llround(rate);
+    self->transport.beat_in_measure = 0.0;
+    // Rolling until the host says otherwise
+    self->transport.speed = 1.0;
     self->triggered = false;
-    self->octave_up = false;
-    self->arp_up    = true;
-    self->active_notes_index = 0;
-    self->note_played = 0;
-    self->active_notes = 0;
-    self->previous_octave_mode = 0;
-    self->octave_index = 0;
-    self->previous_latch = 0;
-    self->previous_midinote = 0;
+    self->step_index = 0;
+    self->seq_length = 0;
+    self->program_length = 0;
+    self->program_dirty = true;
     self->notes_pressed = 0;
     self->latch_playing = false;
     self->first_note = false;
 
-    for (unsigned i = 0; i < NUM_VOICES; i++) {
-        self->midi_notes[i] = 200;
-    }
-    for (unsigned i = 0; i < NUM_VOICES; i++) {
-        for (unsigned x = 0; x < 2; x++) {
-            self->noteoff_buffer[i][x] = 0;
-        }
-    }
+    heldNotesClear(&self->held_notes);
+    noteOffQueueClear(&self->noteoff_queue);
+    outQueueClear(&self->out_queue);
 
     return (LV2_Handle)self;
 }
@@ -462,43 +744,286 @@ instantiate(const LV2_Descriptor*     descriptor,
 
 
 
+// Position of the host transport in the bar at a frame of the current
+// block, in phase units, extrapolated from the last beat position the host
+// sent
+static uint64_t
+hostPosition(Arpeggiator* self, uint32_t frame)
+{
+    const Transport* transport = &self->transport;
+    const double elapsed = transportElapsed(transport, self->frame_count + frame);
+    double beat = transport->beat_in_measure + elapsed * transport->bpm / (60.0 * self->samplerate);
+    beat = (beat > 0.0) ? beat : 0.0;
+
+    return (uint64_t)(beat * TICKS_PER_BEAT * (double)self->units_per_tick);
+}
+
+
+// Phase of the host transport at a frame of the current block
+static uint64_t
+resetPhase(Arpeggiator* self, uint32_t frame)
+{
+    return hostPosition(self, frame) % self->step_length;
+}
+
+
+// Follow the host when its position no longer matches the phase, e.g. after
+// a relocation. Differences within the rounding of the host's beat position
+// are ignored. Only a correction into the next step plays a note; when the
+// host is still in the previous step, the step that played early waits at
+// its start instead of firing twice.
 static void
-update_position(Arpeggiator* self, const LV2_Atom_Object* obj)
+syncPhase(Arpeggiator* self, uint32_t frame)
 {
-    const ClockURIs* uris = &self->uris;
+    const int64_t length = (int64_t)self->step_length;
+    const int64_t tolerance = (int64_t)(transportTolerance(&self->transport, self->samplerate) * self->phase_inc);
+    const uint64_t host_phase = resetPhase(self, frame);
+
+    // A step boundary that was reached but not handled yet
+    if (self->phase >= self->step_length) {
+        self->phase -= self->step_length;
+        self->triggered = false;
+    }
 
-    // Received new transport position/speed
-    LV2_Atom *beat = NULL, *bpm = NULL, *speed = NULL;
-    lv2_atom_object_get(obj,
-            uris->time_barBeat, &beat,
-            uris->time_beatsPerMinute, &bpm,
-            uris->time_speed, &speed,
-            NULL);
-    if (bpm && bpm->type == uris->atom_Float)
-    {
-        // Tempo changed, update BPM
-        self->bpm = ((LV2_Atom_Float*)bpm)->body;
+    int64_t diff = (int64_t)host_phase - (int64_t)self->phase;
+
+    diff = (diff > length / 2) ? diff - length : (diff < -length / 2) ? diff + length : diff;
+
+    if (llabs(diff) <= tolerance) {
+        return;
     }
-    if (speed && speed->type == uris->atom_Float)
-    {
-        // Speed changed, e.g. 0 (stop) to 1 (play)
-        self->speed = ((LV2_Atom_Float*)speed)->body;
+    if ((int64_t)self->phase + diff >= length) {
+        self->phase = host_phase;
+        self->triggered = false;
+    } else if ((int64_t)self->phase + diff < 0) {
+        self->phase = self->triggered ? 0 : host_phase;
+    } else {
+        self->phase = host_phase;
     }
-    if (beat && beat->type == uris->atom_Float)
-    {
-        // Received a beat position, synchronise
-        self->beat_in_measure = ((LV2_Atom_Float*)beat)->body;
+    traceWrite(&self->trace, self->frame_count + frame, TRACE_PHASE_RESET, (uint32_t)(self->phase / self->units_per_tick), 0, 0);
+}
+
+
+// The host transport started again: line the phase up with the host
+// position and play the arpeggio from its first note, on the next step
+static void
+restartPhase(Arpeggiator* self, uint32_t frame)
+{
+    self->phase = resetPhase(self, frame);
+    self->step_index = 0;
+    self->seq_length = 0;
+    self->triggered = false;
+    self->first_note = false;
+    traceWrite(&self->trace, self->frame_count + frame, TRACE_PHASE_RESET, (uint32_t)(self->phase / self->units_per_tick), 0, 0);
+}
+
+
+// The host jumped to another position, e.g. the start of a loop. The notes
+// that sound end here and the arpeggio continues as if it had played from
+// the start of the bar: the phase and the step come from the host position,
+// so a loop back to the bar start plays the first note again.
+static void
+relocate(Arpeggiator* self, uint32_t frame)
+{
+    const uint64_t position = hostPosition(self, frame);
+
+    flushNoteOffs(self, frame);
+    if (self->program_dirty) {
+        buildProgram(self);
     }
+
+    self->phase = position % self->step_length;
+    self->triggered = false;
+    self->first_note = false;
+
+    // A step in its second half has played, the next one is due
+    const uint64_t step = position / self->step_length + (self->phase >= self->step_length / 2);
+    self->step_index = (self->program_length > 0) ? step % self->program_length : 0;
+    traceWrite(&self->trace, self->frame_count + frame, TRACE_PHASE_RESET, (uint32_t)(self->phase / self->units_per_tick), 0, 0);
 }
 
 
+// Hold the first note of the arpeggio back to the next step boundary of the
+// host's grid. The phase is taken from the host position at this frame, so
+// scheduleEvents() finds the frame of that boundary directly. A boundary that
+// passed within the last frame counts as now.
+static void
+quantizeStart(Arpeggiator* self, uint32_t frame)
+{
+    self->phase = resetPhase(self, frame);
+    self->triggered = self->phase >= self->phase_inc;
+    traceWrite(&self->trace, self->frame_count + frame, TRACE_PHASE_RESET, (uint32_t)(self->phase / self->units_per_tick), 0, 0);
+}
 
+
+static void
+updateTiming(Arpeggiator* self)
+{
+    // The divisions are fractions of a half note, rounding the step to whole
+    // ticks makes the dotted values like 2.66666 exact
+    uint64_t ticks_per_step = (uint64_t)llround(TICKS_PER_BEAT * 2.0 / self->params.divisions);
+    uint64_t milli_bpm = (uint64_t)llround(self->transport.bpm * 1000.0);
+
+    ticks_per_step = (ticks_per_step < 1) ? 1 : ticks_per_step;
+    milli_bpm = (milli_bpm < 1) ? 1 : milli_bpm;
+
+    self->step_length = ticks_per_step * self->units_per_tick;
+    self->phase_inc = milli_bpm * TICKS_PER_BEAT;
+    self->note_off_length = (uint32_t)(self->params.note_length * self->step_length / self->phase_inc);
+    self->note_off_length = (self->note_off_length < 1) ? 1 : self->note_off_length;
+}
+
+
+// Take a snapshot of the control ports and report which of them changed
 static uint32_t
-resetPhase(Arpeggiator* self)
+readParams(Arpeggiator* self)
 {
-    uint32_t pos = (uint32_t)fmod(self->samplerate * (60.0f / self->bpm) * self->beat_in_measure, (self->samplerate * (60.0f / (self->bpm * (self->divisions / 2.0f)))));
+    ArpParams params;
+    uint32_t changed = 0;
+
+    params.bpm           = *self->changeBpm;
+    params.arp_mode      = (int)*self->arp_mode;
+    params.latch         = *self->latch_mode == 1;
+    params.divisions     = *self->changedDiv;
+    params.sync          = (int)*self->sync;
+    params.note_length   = *self->note_length;
+    params.octave_spread = (int)*self->octaveSpreadParam;
+    params.octave_spread = (params.octave_spread < 1) ? 1 : params.octave_spread;
+    params.octave_spread = (params.octave_spread > MAX_OCTAVES) ? MAX_OCTAVES : params.octave_spread;
+    params.octave_mode   = (int)*self->octaveModeParam;
+    params.velocity      = (uint8_t)*self->velocity;
+    params.enabled       = *self->bypass == 1;
+    params.seed          = (uint32_t)*self->seed;
+    // Tracing needs the worker to drain the records
+    params.trace         = self->host.schedule && self->trace_port && *self->trace_port == 1;
+
+    const ArpParams* old = &self->params;
+
+    if (!self->params_valid) {
+        changed = PARAMS_ALL;
+        self->params_valid = true;
+    } else {
+        if (params.bpm != old->bpm || params.note_length != old->note_length) {
+            changed |= PARAMS_TEMPO;
+        }
+        if (params.sync != old->sync || params.divisions != old->divisions) {
+            changed |= PARAMS_PHASE;
+        }
+        if (params.latch != old->latch) {
+            changed |= PARAMS_LATCH;
+        }
+        if (params.arp_mode != old->arp_mode || params.octave_spread != old->octave_spread
+                || params.octave_mode != old->octave_mode) {
+            changed |= PARAMS_PATTERN;
+        }
+        if (params.seed != old->seed) {
+            changed |= PARAMS_SEED;
+        }
+    }
+    const bool sync_changed = (changed == PARAMS_ALL) || params.sync != old->sync;
+    self->params = params;
+    self->trace.enabled = params.trace;
 
-    return pos;
+    if (sync_changed) {
+        traceWrite(&self->trace, self->frame_count, TRACE_SYNC, (uint32_t)params.sync, 0, 0);
+    }
+
+    return changed;
+}
+
+
+static void
+setGate(Arpeggiator* self, uint32_t start, uint32_t end)
+{
+    const float gate = (self->notes_pressed > 0) ? 1.0 : 0.0;
+
+    for (uint32_t i = start; i < end; i++) {
+        self->cv_gate[i] = gate;
+    }
+}
+
+
+// Move the phase over a number of frames without playing anything, leaving
+// the same state as the step loop of scheduleEvents() would: the phase wraps
+// at every step boundary before the last frame and a step counts as
+// triggered when the phase was in its first half at the last boundary.
+static void
+skipSteps(Arpeggiator* self, uint32_t frames)
+{
+    const uint64_t length = self->step_length;
+    const uint64_t inc = self->phase_inc;
+    uint64_t phase = self->phase;
+
+    if (phase >= length) {
+        phase -= length;
+        self->triggered = false;
+    }
+    self->triggered = self->triggered || phase < length / 2;
+    self->first_note = false;
+
+    const uint64_t steps = (phase + (frames - 1) * inc) / length;
+    if (steps > 0) {
+        const uint64_t last = (steps * length - phase + inc - 1) / inc;
+        self->triggered = phase + last * inc - steps * length < length / 2;
+    }
+    self->phase = phase + frames * inc - steps * length;
+}
+
+
+// Generate the arpeggio between two frames of the current block. Instead of
+// stepping through every sample this jumps straight from one step boundary or
+// pending note off to the next, so every event gets the exact frame offset.
+static void
+scheduleEvents(Arpeggiator* self, uint32_t start, uint32_t end)
+{
+    uint32_t frame = start;
+
+    setGate(self, start, end);
+
+    // The host transport is stopped, the arpeggio waits where it is. Notes
+    // still sounding end right away instead of when their step ends.
+    if (self->params.sync > 0 && self->transport.speed == 0) {
+        if (start < end) {
+            flushNoteOffs(self, start);
+        }
+        return;
+    }
+
+    // Nothing held and no note to end, only the phase moves on. Releasing the
+    // last key left the program to be emptied, like the next step would.
+    if (self->held_notes.count == 0 && self->noteoff_queue.count == 0) {
+        if (self->program_dirty) {
+            buildProgram(self);
+        }
+        if (end > start) {
+            skipSteps(self, end - start);
+        }
+        return;
+    }
+
+    while (frame < end) {
+        if (self->phase >= self->step_length) {
+            self->phase -= self->step_length;
+            self->triggered = false;
+        }
+
+        handleNoteOff(self, frame);
+
+        if ((self->phase < self->step_length / 2 && !self->triggered) || self->first_note) {
+            //trigger MIDI message
+            handleNoteOn(self, frame);
+            self->triggered = true;
+            self->first_note = false;
+        }
+
+        const uint64_t to_step = (self->step_length - self->phase + self->phase_inc - 1) / self->phase_inc;
+        uint32_t frames = (end - frame < to_step) ? end - frame : (uint32_t)to_step;
+        frames = nextNoteOff(self, frame, frames);
+        frames = (frames < 1) ? 1 : frames;
+
+        self->phase += frames * self->phase_inc;
+        frame += frames;
+    }
 }
 
 
@@ -507,8 +1032,9 @@ run(LV2_Handle instance, uint32_t n_samples)
 {
     Arpeggiator* self = (Arpeggiator*)instance;
     const ClockURIs* uris = &self->uris;
+    const uint64_t start_time = self->metrics_out ? monotonicTime() : 0;
 
-    float current_beat_pos = self->beat_in_measure;
+    uint32_t offset = 0;
 
     self->MIDI_out->atom.type = self->MIDI_in->atom.type;
     const uint32_t out_capacity = self->MIDI_out->atom.size;
@@ -516,91 +1042,118 @@ run(LV2_Handle instance, uint32_t n_samples)
     // Write an empty Sequence header to the output
     lv2_atom_sequence_clear(self->MIDI_out);
 
-    // Read incoming events
+    const bool activated = !self->params_valid;
+    uint32_t changed = readParams(self);
+    const ArpParams* params = &self->params;
+
+    if ((changed & PARAMS_LATCH) && !params->latch && self->notes_pressed <= 0) {
+        heldNotesClear(&self->held_notes);
+        self->step_index = 0;
+        self->seq_length = 0;
+        self->program_dirty = true;
+    }
+    if (changed & PARAMS_PATTERN) {
+        // A new pattern does not go on from the old one's notes
+        self->seq_length = 0;
+        self->program_dirty = true;
+    }
+    if (changed & PARAMS_SEED) {
+        randomSeed(self, params->seed);
+        self->program_dirty = true;
+    }
+
+    //map bpm to host or to bpm parameter, the sync modes start at the
+    //bpm parameter until the host sends its tempo
+    if ((params->sync == 0 || activated) && self->transport.bpm != params->bpm) {
+        self->transport.bpm = params->bpm;
+        changed |= PARAMS_TEMPO;
+    }
+    //reset phase when sync is turned on or when there is a new division
+    if (changed & PARAMS_PHASE) {
+        updateTiming(self);
+        self->phase = resetPhase(self, 0);
+        traceWrite(&self->trace, self->frame_count, TRACE_PHASE_RESET, (uint32_t)(self->phase / self->units_per_tick), 0, 0);
+    } else if (changed & PARAMS_TEMPO) {
+        updateTiming(self);
+    }
+
+    // Read incoming events, generating the arpeggio up to each one of them
     LV2_ATOM_SEQUENCE_FOREACH(self->MIDI_in, ev)
     {
-        size_t search_note;
+        uint32_t ev_frame = (ev->time.frames < n_samples) ? (uint32_t)ev->time.frames : n_samples;
+        ev_frame = (ev_frame < offset) ? offset : ev_frame;
+
+        scheduleEvents(self, offset, ev_frame);
+        offset = ev_frame;
+
         if (ev->body.type == uris->atom_Object ||
                 ev->body.type == uris->atom_Blank) {
             const LV2_Atom_Object* obj = (const LV2_Atom_Object*)&ev->body;
             if (obj->body.otype == uris->time_Position) {
-                update_position(self, obj);
+                const bool was_stopped = self->transport.speed == 0;
+                const uint32_t update = transportUpdate(&self->transport, uris, obj, self->frame_count + ev_frame);
+                // Free running, the tempo comes from the Bpm control only
+                if (params->sync == 0) {
+                    self->transport.bpm = params->bpm;
+                }
+                updateTiming(self);
+                if (was_stopped && self->transport.speed != 0 && params->sync > 0) {
+                    restartPhase(self, ev_frame);
+                } else if ((update & TRANSPORT_BEAT) && params->sync > 0) {
+                    if ((update & TRANSPORT_RELOCATED) && self->transport.speed != 0) {
+                        relocate(self, ev_frame);
+                    } else {
+                        syncPhase(self, ev_frame);
+                    }
+                }
             }
         }
-        else if (ev->body.type == self->urid_midiEvent)
+        else if (ev->body.type == uris->midi_MidiEvent)
         {
             const uint8_t* const msg = (const uint8_t*)(ev + 1);
 
             const uint8_t status = msg[0] & 0xF0;
 
-            if (*self->bypass == 1) {
+            self->metrics.events_in++;
+
+            if (params->enabled) {
 
                 uint8_t midi_note = msg[1];
-                uint8_t note_to_find;
-                size_t find_free_voice;
-                bool voice_found;
 
                 switch (status)
                 {
                     case LV2_MIDI_MSG_NOTE_ON:
                         if (self->notes_pressed == 0) {
                             if (!self->latch_playing) { //TODO check if there needs to be an exception when using sync
-                                if (*self->sync == 0) {
-                                    self->pos = 0;
+                                if (params->sync == 0) {
+                                    self->phase = 0;
+                                    traceWrite(&self->trace, self->frame_count + ev_frame, TRACE_PHASE_RESET, 0, 0, 0);
                                 }
-                                self->octave_index = 0;
-                                self->note_played = 0;
+                                self->step_index = 0;
+                                self->seq_length = 0;
                                 self->triggered = false;
+                                if (params->sync == 2) {
+                                    quantizeStart(self, ev_frame);
+                                }
                             }
-                            if (*self->latch_mode == 1) {
+                            if (params->latch) {
                                 self->latch_playing = true;
-                                self->active_notes = 0;
-                                for (unsigned i = 0; i < NUM_VOICES; i++) {
-                                    self->midi_notes[i] = 200;
-                                }
+                                heldNotesClear(&self->held_notes);
                             }
-                            if (*self->sync == 1 && !self->latch_playing) {
+                            if (params->sync == 1 && !self->latch_playing) {
                                 self->first_note = true;
                             }
                         }
                         self->notes_pressed++;
-                        self->active_notes++;
-                        find_free_voice = 0;
-                        voice_found = false;
-                        while (find_free_voice < NUM_VOICES && !voice_found)
-                        {
-                            if (self->midi_notes[find_free_voice] == 200) {
-                                self->midi_notes[find_free_voice] = midi_note;
-                                voice_found = true;
-                            }
-                            find_free_voice++;
-                        }
-                        if (*self->arp_mode != 4)
-                            quicksort(self->midi_notes, 0, NUM_VOICES - 1);
-                        if (midi_note < self->midi_notes[self->note_played - 1] &&
-                                self->note_played > 0) {
-                            self->note_played++;
-                        }
+                        heldNotesInsert(&self->held_notes, midi_note);
+                        self->program_dirty = true;
                         break;
                     case LV2_MIDI_MSG_NOTE_OFF:
-                        self->notes_pressed--;
-                        if (!self->latch_playing)
-                            self->active_notes = self->notes_pressed;
-                        note_to_find = midi_note;
-                        search_note = 0;
-                        if (*self->latch_mode == 0) {
+                        self->notes_pressed = (self->notes_pressed > 0) ? self->notes_pressed - 1 : 0;
+                        if (!params->latch) {
                             self->latch_playing = false;
-                            while (search_note < NUM_VOICES)
-                            {
-                                if (self->midi_notes[search_note] == note_to_find)
-                                {
-                                    self->midi_notes[search_note] = 200;
-                                    search_note = NUM_VOICES;
-                                }
-                                search_note++;
-                            }
-                            if (*self->arp_mode != 4)
-                                quicksort(self->midi_notes, 0, NUM_VOICES - 1);
+                            heldNotesRemove(&self->held_notes, midi_note);
+                            self->program_dirty = true;
                         }
                         break;
                     default:
@@ -609,66 +1162,28 @@ run(LV2_Handle instance, uint32_t n_samples)
             }
             else {
                 //send MIDI message through
-                lv2_atom_sequence_append_event(self->MIDI_out, out_capacity, ev);
+                outQueuePush(&self->out_queue, ev_frame, msg, ev->body.size);
 
             }
         }
     }
 
-    if (*self->latch_mode == 0 && self->previous_latch == 1 && self->notes_pressed <= 0) {
-        for (unsigned i = 0; i < NUM_VOICES; i++) {
-            self->midi_notes[i] = 200;
-            self->note_played = 0;
-        }
-    }
-    if (*self->latch_mode != self->previous_latch) {
-        self->previous_latch = *self->latch_mode;
-    }
+    scheduleEvents(self, offset, n_samples);
 
-    for(uint32_t i = 0; i < n_samples; i ++) {
-        //map bpm to host or to bpm parameter
-        if (*self->sync == 0) {
-            self->bpm = *self->changeBpm;
-        } else {
-            self->bpm = self->bpm;
-        }
-        //reset phase when sync is turned on
-        if (*self->sync != self->prev_sync) {
-            self->pos = resetPhase(self);
-            self->prev_sync = *self->sync;
-        }
-        //reset phase when there is a new division
-        if (self->divisions != *self->changedDiv) {
-            self->divisions = *self->changedDiv;
-            self->pos = resetPhase(self);
-        }
-        //set CV gate
-        if (self->notes_pressed > 0) {
-            self->cv_gate[i] = 1.0;
-        } else {
-            self->cv_gate[i] = 0.0;
-        }
+    const uint64_t deferred = self->out_queue.deferred;
+    const uint64_t dropped = self->out_queue.dropped;
 
-        self->period = (uint32_t)(self->samplerate * (60.0f / (self->bpm * (self->divisions / 2.0f))));
-        self->h_wavelength = (self->period/2.0f);
-
-        if(self->pos >= self->period && i < n_samples) {
-            self->pos = 0;
-        } else {
-            if((self->pos < self->h_wavelength && !self->triggered) || self->first_note) {
-                //trigger MIDI message
-                handleNoteOn(self, out_capacity);
-                self->triggered = true;
-                self->first_note = false;
-            } else if (self->pos > self->h_wavelength) {
-                //set gate
-                self->triggered = false;
-            }
-        }
-        handleNoteOff(self, out_capacity);
-        self->pos += 1;
+    self->metrics.events_out += outQueueFlush(&self->out_queue, self->MIDI_out, out_capacity, uris->midi_MidiEvent);
+    traceFlushCounts(&self->trace, &self->out_queue, self->frame_count + n_samples, deferred, dropped);
+    traceSchedule(&self->trace, self->host.schedule);
+    self->frame_count += n_samples;
+
+    if (self->metrics_out) {
+        const MetricsNotes notes = { self->held_notes.count, self->noteoff_queue.count };
+
+        metricsWrite(&self->metrics, &self->forge, self->metrics_out, &self->metrics_uris, &self->out_queue,
+                &notes, self->samplerate, n_samples, start_time);
     }
-    self->previous_beat_in_measure = current_beat_pos;
 }
 
 
@@ -684,13 +1199,42 @@ cleanup(LV2_Handle instance)
     free(instance);
 }
 
+// Drain the trace outside of the audio thread
+static LV2_Worker_Status
+work(LV2_Handle                  instance,
+        LV2_Worker_Respond_Function respond,
+        LV2_Worker_Respond_Handle   handle,
+        uint32_t                    size,
+        const void*                 data)
+{
+    Arpeggiator* self = (Arpeggiator*)instance;
+
+    traceDrain(&self->trace, &self->logger, "arpeggiator");
+
+    return respond(handle, 0, NULL);
+}
+
+static LV2_Worker_Status
+work_response(LV2_Handle instance, uint32_t size, const void* data)
+{
+    ((Arpeggiator*)instance)->trace.scheduled = false;
+
+    return LV2_WORKER_SUCCESS;
+}
+
 static const void*
 extension_data(const char* uri)
 {
+    static const LV2_Worker_Interface worker = { work, work_response, NULL };
+
+    if (!strcmp(uri, LV2_WORKER__interface)) {
+        return &worker;
+    }
+
     return NULL;
 }
 
-static const LV2_Descriptor descriptor = {
+const LV2_Descriptor arpeggiator_descriptor = {
     PLUGIN_URI,
     instantiate,
     connect_port,
@@ -700,13 +1244,3 @@ static const LV2_Descriptor descriptor = {
     cleanup,
     extension_data
 };
-
-LV2_SYMBOL_EXPORT
-    const LV2_Descriptor*
-lv2_descriptor(uint32_t index)
-{
-    switch (index) {
-        case 0:  return &descriptor;
-        default: return NULL;
-    }
-}
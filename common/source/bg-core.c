@@ -0,0 +1,409 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bg-core.h"
+
+
+static const char* const trace_names[] = {
+    "step", "note-on", "note-off", "phase-reset", "sync", "retrigger", "deferred", "dropped"
+};
+
+
+void
+hostFeaturesGet(HostFeatures* host, const LV2_Feature* const* features)
+{
+    memset(host, 0, sizeof(HostFeatures));
+
+    for (uint32_t i=0; features[i]; ++i)
+    {
+        if (!strcmp (features[i]->URI, LV2_URID__map))
+        {
+            host->map = (LV2_URID_Map*)features[i]->data;
+        }
+        else if (!strcmp (features[i]->URI, LV2_LOG__log))
+        {
+            host->log = (LV2_Log_Log*)features[i]->data;
+        }
+        else if (!strcmp (features[i]->URI, LV2_WORKER__schedule))
+        {
+            host->schedule = (LV2_Worker_Schedule*)features[i]->data;
+        }
+    }
+}
+
+
+void
+clockURIsMap(ClockURIs* uris, LV2_URID_Map* map)
+{
+    uris->atom_Blank          = map->map(map->handle, LV2_ATOM__Blank);
+    uris->atom_Float          = map->map(map->handle, LV2_ATOM__Float);
+    uris->atom_Long           = map->map(map->handle, LV2_ATOM__Long);
+    uris->atom_Object         = map->map(map->handle, LV2_ATOM__Object);
+    uris->atom_Path           = map->map(map->handle, LV2_ATOM__Path);
+    uris->atom_Resource       = map->map(map->handle, LV2_ATOM__Resource);
+    uris->atom_Sequence       = map->map(map->handle, LV2_ATOM__Sequence);
+    uris->midi_MidiEvent      = map->map(map->handle, LV2_MIDI__MidiEvent);
+    uris->time_Position       = map->map(map->handle, LV2_TIME__Position);
+    uris->time_barBeat        = map->map(map->handle, LV2_TIME__barBeat);
+    uris->time_beatsPerMinute = map->map(map->handle, LV2_TIME__beatsPerMinute);
+    uris->time_frame          = map->map(map->handle, LV2_TIME__frame);
+    uris->time_speed          = map->map(map->handle, LV2_TIME__speed);
+}
+
+
+// Forget where the host transport was, on activation
+void
+transportReset(Transport* transport)
+{
+    transport->position_frame = 0;
+    transport->has_host_frame = false;
+}
+
+
+// Apply a transport position received at an absolute frame. When the host
+// sends its frame position too, it is compared with where the transport
+// should be by now after moving at its previous speed; a difference of more
+// than a frame is a jump of the host.
+uint32_t
+transportUpdate(Transport* transport, const ClockURIs* uris, const LV2_Atom_Object* obj, uint64_t frame)
+{
+    // Received new transport position/speed
+    LV2_Atom *beat = NULL, *bpm = NULL, *speed = NULL, *host_frame = NULL;
+    uint32_t changes = 0;
+
+    lv2_atom_object_get(obj,
+            uris->time_barBeat, &beat,
+            uris->time_beatsPerMinute, &bpm,
+            uris->time_frame, &host_frame,
+            uris->time_speed, &speed,
+            NULL);
+    if (host_frame && host_frame->type == uris->atom_Long) {
+        const int64_t reported = ((LV2_Atom_Long*)host_frame)->body;
+
+        if (transport->has_host_frame) {
+            const int64_t expected = transport->host_frame
+                + (int64_t)llround((double)(frame - transport->host_frame_at) * transport->speed);
+            if (llabs(reported - expected) > 1) {
+                changes |= TRANSPORT_RELOCATED;
+            }
+        }
+        transport->host_frame = reported;
+        transport->host_frame_at = frame;
+        transport->has_host_frame = true;
+    }
+    if (bpm && bpm->type == uris->atom_Float)
+    {
+        // Tempo changed, update BPM
+        transport->bpm = ((LV2_Atom_Float*)bpm)->body;
+    }
+    if (speed && speed->type == uris->atom_Float)
+    {
+        // Speed changed, e.g. 0 (stop) to 1 (play)
+        transport->speed = ((LV2_Atom_Float*)speed)->body;
+    }
+    if (beat && beat->type == uris->atom_Float)
+    {
+        // Received a beat position, synchronise
+        transport->beat_in_measure = ((LV2_Atom_Float*)beat)->body;
+        transport->position_frame = frame;
+        changes |= TRANSPORT_BEAT;
+    }
+
+    return changes;
+}
+
+
+// Frames the host transport moved since its last beat position, up to an
+// absolute frame
+double
+transportElapsed(const Transport* transport, uint64_t frame)
+{
+    return (double)(frame - transport->position_frame) * transport->speed;
+}
+
+
+// Frames by which a beat position of the host may be off because of rounding
+double
+transportTolerance(const Transport* transport, double samplerate)
+{
+    const double frames = (transport->bpm > 0) ? samplerate * 60.0 / transport->bpm * SYNC_TOLERANCE_BEATS : 0.0;
+
+    return (frames > SYNC_TOLERANCE_FRAMES) ? frames : SYNC_TOLERANCE_FRAMES;
+}
+
+
+bool
+isNoteOff(const uint8_t* msg, uint32_t size)
+{
+    const uint8_t status = msg[0] & 0xF0;
+
+    return size == 3 && (status == LV2_MIDI_MSG_NOTE_OFF
+            || (status == LV2_MIDI_MSG_NOTE_ON && msg[2] == 0));
+}
+
+
+void
+outQueueClear(OutQueue* queue)
+{
+    queue->count = 0;
+}
+
+
+// Stage an event for the output. Everything but note offs has to leave room
+// for every key to be released, so a note that was started can always end.
+bool
+outQueuePush(OutQueue* queue, uint32_t frame, const uint8_t* msg, uint32_t size)
+{
+    const size_t limit = isNoteOff(msg, size) ? OUT_QUEUE_SIZE : OUT_QUEUE_SIZE - NUM_KEYS;
+
+    if (queue->count >= limit) {
+        queue->dropped++;
+        return false;
+    }
+
+    OutEvent* event = &queue->events[queue->count++];
+    event->frame = frame;
+    event->size = size;
+    if (size <= sizeof(event->msg)) {
+        memcpy(event->msg, msg, size);
+        event->ref = NULL;
+    } else {
+        event->ref = msg;
+    }
+
+    return true;
+}
+
+
+// Write as much of the staged events to the output as fits. When the host
+// buffer runs out, note offs of notes that are already sounding go first and
+// the other events follow in order until the buffer is full. The rest is
+// carried over to the start of the next block.
+size_t
+outQueueFlush(OutQueue* queue, LV2_Atom_Sequence* seq, uint32_t capacity, LV2_URID type)
+{
+    uint32_t space = (capacity > seq->atom.size) ? capacity - seq->atom.size : 0;
+    uint32_t reserved = 0;
+    uint64_t started[2] = { 0, 0 };
+    bool urgent[OUT_QUEUE_SIZE];
+    bool full = false;
+    size_t kept = 0;
+    size_t written = 0;
+
+    // A note off whose note on is still in the queue is not urgent, it can
+    // never be written before that note on anyway
+    for (size_t i = 0; i < queue->count; i++) {
+        const OutEvent* event = &queue->events[i];
+        const uint8_t key = event->msg[1] & 0x7F;
+
+        urgent[i] = false;
+        if (isNoteOff(event->msg, event->size)) {
+            if (!((started[key >> 6] >> (key & 63)) & 1)) {
+                urgent[i] = true;
+                reserved += lv2_atom_pad_size(sizeof(LV2_Atom_Event) + event->size);
+            }
+        } else if (event->size == 3 && (event->msg[0] & 0xF0) == LV2_MIDI_MSG_NOTE_ON) {
+            started[key >> 6] |= (uint64_t)1 << (key & 63);
+        }
+    }
+
+    for (size_t i = 0; i < queue->count; i++) {
+        const OutEvent event = queue->events[i];
+        const uint8_t* body = event.ref ? event.ref : event.msg;
+        const uint32_t size = lv2_atom_pad_size(sizeof(LV2_Atom_Event) + event.size);
+        bool fits;
+
+        if (urgent[i]) {
+            reserved -= size;
+            fits = size <= space;
+        } else {
+            fits = !full && size + reserved <= space;
+            full = !fits;
+        }
+
+        if (fits) {
+            LV2_Atom_Event* out = lv2_atom_sequence_end(&seq->body, seq->atom.size);
+            out->time.frames = event.frame;
+            out->body.type = type;
+            out->body.size = event.size;
+            memcpy(out + 1, body, event.size);
+            seq->atom.size += size;
+            space -= size;
+            written++;
+        } else if (event.ref) {
+            queue->dropped++;
+        } else {
+            queue->events[kept] = event;
+            queue->events[kept++].frame = 0;
+            queue->deferred++;
+        }
+    }
+
+    queue->count = kept;
+
+    return written;
+}
+
+
+void
+metricsURIsMap(MetricsURIs* uris, LV2_URID_Map* map, const char* plugin_uri)
+{
+    static const char* const names[] = {
+        "#Metrics", "#blocks", "#eventsIn", "#eventsOut", "#deferred", "#dropped",
+        "#heldNotes", "#pendingNoteOffs", "#stepsFired", "#runTimeAvg", "#runTimeMax"
+    };
+    LV2_URID* const urids[] = {
+        &uris->Metrics, &uris->blocks, &uris->eventsIn, &uris->eventsOut, &uris->deferred, &uris->dropped,
+        &uris->heldNotes, &uris->pendingNoteOffs, &uris->stepsFired, &uris->runTimeAvg, &uris->runTimeMax
+    };
+    char uri[256];
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        snprintf(uri, sizeof(uri), "%s%s", plugin_uri, names[i]);
+        *urids[i] = map->map(map->handle, uri);
+    }
+}
+
+
+// Monotonic time in nanoseconds, for measuring run()
+uint64_t
+monotonicTime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+
+// Account for a run() and publish the counters on the metrics port a few
+// times per second. The held notes are only published when given.
+void
+metricsWrite(Metrics* metrics, LV2_Atom_Forge* forge, LV2_Atom_Sequence* out, const MetricsURIs* uris,
+        const OutQueue* queue, const MetricsNotes* notes, double samplerate, uint32_t n_samples,
+        uint64_t start_time)
+{
+    LV2_Atom_Forge_Frame seq_frame;
+    const uint64_t run_time = monotonicTime() - start_time;
+
+    metrics->frames += n_samples;
+    metrics->blocks++;
+    metrics->run_time += run_time;
+    metrics->run_time_max = (run_time > metrics->run_time_max) ? run_time : metrics->run_time_max;
+
+    lv2_atom_forge_set_buffer(forge, (uint8_t*)out, out->atom.size);
+    lv2_atom_forge_sequence_head(forge, &seq_frame, 0);
+
+    if (metrics->frames >= samplerate / METRICS_RATE) {
+        LV2_Atom_Forge_Frame frame;
+
+        lv2_atom_forge_frame_time(forge, 0);
+        lv2_atom_forge_object(forge, &frame, 0, uris->Metrics);
+        lv2_atom_forge_key(forge, uris->blocks);
+        lv2_atom_forge_long(forge, metrics->blocks);
+        lv2_atom_forge_key(forge, uris->eventsIn);
+        lv2_atom_forge_long(forge, metrics->events_in);
+        lv2_atom_forge_key(forge, uris->eventsOut);
+        lv2_atom_forge_long(forge, metrics->events_out);
+        lv2_atom_forge_key(forge, uris->deferred);
+        lv2_atom_forge_long(forge, (int64_t)queue->deferred);
+        lv2_atom_forge_key(forge, uris->dropped);
+        lv2_atom_forge_long(forge, (int64_t)queue->dropped);
+        if (notes) {
+            lv2_atom_forge_key(forge, uris->heldNotes);
+            lv2_atom_forge_long(forge, (int64_t)notes->held);
+            lv2_atom_forge_key(forge, uris->pendingNoteOffs);
+            lv2_atom_forge_long(forge, (int64_t)notes->pending_note_offs);
+        }
+        lv2_atom_forge_key(forge, uris->stepsFired);
+        lv2_atom_forge_long(forge, metrics->steps);
+        // Run times in microseconds
+        lv2_atom_forge_key(forge, uris->runTimeAvg);
+        lv2_atom_forge_float(forge, metrics->run_time / 1000.0f / metrics->blocks);
+        lv2_atom_forge_key(forge, uris->runTimeMax);
+        lv2_atom_forge_float(forge, metrics->run_time_max / 1000.0f);
+        lv2_atom_forge_pop(forge, &frame);
+
+        memset(metrics, 0, sizeof(Metrics));
+    }
+
+    lv2_atom_forge_pop(forge, &seq_frame);
+}
+
+
+// Append a record to the trace when tracing is switched on
+void
+traceWrite(TraceRing* ring, uint64_t frame, TraceType type, uint32_t value, uint8_t note, uint8_t velocity)
+{
+    if (!ring->enabled) {
+        return;
+    }
+
+    const uint32_t write = ring->write;
+
+    if (write - __atomic_load_n(&ring->read, __ATOMIC_ACQUIRE) >= TRACE_SIZE) {
+        __atomic_add_fetch(&ring->lost, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    TraceRecord* record = &ring->records[write & (TRACE_SIZE - 1)];
+    record->frame = frame;
+    record->value = value;
+    record->type = (uint8_t)type;
+    record->note = note;
+    record->velocity = velocity;
+    __atomic_store_n(&ring->write, write + 1, __ATOMIC_RELEASE);
+}
+
+
+// Record the events a flush of the output queue deferred or dropped, given
+// the queue's counters from before the flush
+void
+traceFlushCounts(TraceRing* ring, const OutQueue* queue, uint64_t frame, uint64_t deferred, uint64_t dropped)
+{
+    if (queue->deferred != deferred) {
+        traceWrite(ring, frame, TRACE_DEFERRED, (uint32_t)(queue->deferred - deferred), 0, 0);
+    }
+    if (queue->dropped != dropped) {
+        traceWrite(ring, frame, TRACE_DROPPED, (uint32_t)(queue->dropped - dropped), 0, 0);
+    }
+}
+
+
+// Hand the trace to the worker, one drain at a time. The worker response
+// clears scheduled again.
+void
+traceSchedule(TraceRing* ring, LV2_Worker_Schedule* schedule)
+{
+    if (schedule && !ring->scheduled
+            && ring->write != __atomic_load_n(&ring->read, __ATOMIC_ACQUIRE)) {
+        ring->scheduled = schedule->schedule_work(schedule->handle, 0, NULL) == LV2_WORKER_SUCCESS;
+    }
+}
+
+
+// Log the records written since the last drain, called by the worker
+void
+traceDrain(TraceRing* ring, LV2_Log_Logger* logger, const char* name)
+{
+    const uint32_t write = __atomic_load_n(&ring->write, __ATOMIC_ACQUIRE);
+    uint32_t read = ring->read;
+
+    while (read != write) {
+        const TraceRecord* record = &ring->records[read & (TRACE_SIZE - 1)];
+
+        lv2_log_trace(logger, "%s: %llu %s %u %u %u\n", name,
+                (unsigned long long)record->frame, trace_names[record->type],
+                record->value, record->note, record->velocity);
+        __atomic_store_n(&ring->read, ++read, __ATOMIC_RELEASE);
+    }
+
+    const uint32_t lost = __atomic_exchange_n(&ring->lost, 0, __ATOMIC_RELAXED);
+    if (lost > 0) {
+        lv2_log_warning(logger, "%s: %u trace records lost\n", name, lost);
+    }
+}
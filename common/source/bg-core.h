@@ -0,0 +1,192 @@
+// Timing, MIDI output, metrics and trace code shared by the plugins, which
+// are all built into one binary
+
+#ifndef BG_CORE_H
+#define BG_CORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <lv2/lv2plug.in/ns/lv2core/lv2.h>
+#include <lv2/lv2plug.in/ns/ext/atom/atom.h>
+#include <lv2/lv2plug.in/ns/ext/atom/forge.h>
+#include <lv2/lv2plug.in/ns/ext/log/logger.h>
+#include <lv2/lv2plug.in/ns/ext/midi/midi.h>
+#include "lv2/lv2plug.in/ns/ext/time/time.h"
+#include <lv2/lv2plug.in/ns/ext/urid/urid.h>
+#include <lv2/lv2plug.in/ns/ext/worker/worker.h>
+
+#define NUM_KEYS 128
+// Outgoing events that can be staged per block, the last NUM_KEYS slots are
+// kept free for note offs
+#define OUT_QUEUE_SIZE 1024
+#define METRICS_RATE 4 // Metrics updates per second
+#define TRACE_SIZE 1024 // Trace records buffered until the worker drains them, a power of two
+// Hosts round their beat positions, JACK for example to ticks of 1/1920
+// beat. Differences below a few of those ticks, or a few frames at fast
+// tempos, are rounding and not a jump of the host.
+#define SYNC_TOLERANCE_BEATS (1.0 / 480.0)
+#define SYNC_TOLERANCE_FRAMES 4
+
+
+// Host features the plugins use, only map is required
+typedef struct {
+    LV2_URID_Map*         map;
+    LV2_Log_Log*          log;
+    LV2_Worker_Schedule*  schedule;
+} HostFeatures;
+
+typedef struct {
+    LV2_URID atom_Blank;
+    LV2_URID atom_Float;
+    LV2_URID atom_Long;
+    LV2_URID atom_Object;
+    LV2_URID atom_Path;
+    LV2_URID atom_Resource;
+    LV2_URID atom_Sequence;
+    LV2_URID midi_MidiEvent;
+    LV2_URID time_Position;
+    LV2_URID time_barBeat;
+    LV2_URID time_beatsPerMinute;
+    LV2_URID time_frame;
+    LV2_URID time_speed;
+} ClockURIs;
+
+// Transport state as last sent by the host
+typedef struct {
+    float     bpm; // Beats per minute (tempo)
+    float     speed; // Transport speed (usually 0=stop, 1=play)
+    float     beat_in_measure;
+    uint64_t  position_frame; // Frame the beat_in_measure refers to
+    int64_t   host_frame; // Position of the host transport in frames, if sent
+    uint64_t  host_frame_at; // Frame the host_frame refers to
+    bool      has_host_frame;
+} Transport;
+
+// What a time:Position told about the host transport
+typedef enum {
+    TRANSPORT_BEAT      = 1 << 0, // It carried a beat position
+    TRANSPORT_RELOCATED = 1 << 1  // The host frame jumped, e.g. a loop or seek
+} TransportChange;
+
+// Outgoing MIDI event waiting to be written to the output sequence. Messages
+// longer than three bytes are not copied, they refer to the input event and
+// can only be delivered in the block they arrived in.
+typedef struct {
+    uint32_t        frame;
+    uint32_t        size;
+    uint8_t         msg[3];
+    const uint8_t*  ref;
+} OutEvent;
+
+// Events generated in the current block, preceded by the ones carried over
+// from earlier blocks because the host's output buffer was full
+typedef struct {
+    OutEvent  events[OUT_QUEUE_SIZE];
+    size_t    count;
+    uint64_t  deferred; // Events delivered in a later block than generated
+    uint64_t  dropped;  // Events lost because the queue itself was full
+} OutQueue;
+
+typedef struct {
+    LV2_URID Metrics;
+    LV2_URID blocks;
+    LV2_URID eventsIn;
+    LV2_URID eventsOut;
+    LV2_URID deferred;
+    LV2_URID dropped;
+    LV2_URID heldNotes;
+    LV2_URID pendingNoteOffs;
+    LV2_URID stepsFired;
+    LV2_URID runTimeAvg;
+    LV2_URID runTimeMax;
+} MetricsURIs;
+
+// Counters published on the metrics port, reset after every update
+typedef struct {
+    uint32_t  frames;
+    uint32_t  blocks;
+    uint32_t  events_in;
+    uint32_t  events_out;
+    uint32_t  steps;
+    uint64_t  run_time; // Nanoseconds
+    uint64_t  run_time_max;
+} Metrics;
+
+// Notes published by the plugins that hold notes themselves
+typedef struct {
+    size_t    held;
+    size_t    pending_note_offs;
+} MetricsNotes;
+
+// Events recorded in the trace
+typedef enum {
+    TRACE_STEP,        // value: step index
+    TRACE_NOTE_ON,
+    TRACE_NOTE_OFF,
+    TRACE_PHASE_RESET, // value: position inside the step
+    TRACE_SYNC,        // value: sync mode
+    TRACE_RETRIGGER,
+    TRACE_DEFERRED,    // value: events carried over to the next block
+    TRACE_DROPPED      // value: events lost
+} TraceType;
+
+typedef struct {
+    uint64_t  frame; // Frames since activation
+    uint32_t  value;
+    uint8_t   type;
+    uint8_t   note;
+    uint8_t   velocity;
+} TraceRecord;
+
+// Ring of trace records with run() as the only producer and the worker as
+// the only consumer. Each side only writes its own index, so neither ever
+// waits for the other; records that do not fit are counted as lost.
+typedef struct {
+    TraceRecord records[TRACE_SIZE];
+    uint32_t    write;
+    uint32_t    read;
+    uint32_t    lost;
+    bool        enabled; // Set by run() from the trace port
+    bool        scheduled; // A drain is pending in the worker
+} TraceRing;
+
+
+void hostFeaturesGet(HostFeatures* host, const LV2_Feature* const* features);
+
+void clockURIsMap(ClockURIs* uris, LV2_URID_Map* map);
+
+void transportReset(Transport* transport);
+
+uint32_t transportUpdate(Transport* transport, const ClockURIs* uris, const LV2_Atom_Object* obj, uint64_t frame);
+
+double transportElapsed(const Transport* transport, uint64_t frame);
+
+double transportTolerance(const Transport* transport, double samplerate);
+
+bool isNoteOff(const uint8_t* msg, uint32_t size);
+
+void outQueueClear(OutQueue* queue);
+
+bool outQueuePush(OutQueue* queue, uint32_t frame, const uint8_t* msg, uint32_t size);
+
+size_t outQueueFlush(OutQueue* queue, LV2_Atom_Sequence* seq, uint32_t capacity, LV2_URID type);
+
+void metricsURIsMap(MetricsURIs* uris, LV2_URID_Map* map, const char* plugin_uri);
+
+uint64_t monotonicTime(void);
+
+void metricsWrite(Metrics* metrics, LV2_Atom_Forge* forge, LV2_Atom_Sequence* out, const MetricsURIs* uris,
+        const OutQueue* queue, const MetricsNotes* notes, double samplerate, uint32_t n_samples,
+        uint64_t start_time);
+
+void traceWrite(TraceRing* ring, uint64_t frame, TraceType type, uint32_t value, uint8_t note, uint8_t velocity);
+
+void traceFlushCounts(TraceRing* ring, const OutQueue* queue, uint64_t frame, uint64_t deferred, uint64_t dropped);
+
+void traceSchedule(TraceRing* ring, LV2_Worker_Schedule* schedule);
+
+void traceDrain(TraceRing* ring, LV2_Log_Logger* logger, const char* name);
+
+#endif
@@ -0,0 +1,18 @@
+// Entry point of the binary, which contains all the plugins
+
+#include "bg-core.h"
+
+extern const LV2_Descriptor arpeggiator_descriptor;
+extern const LV2_Descriptor midi_pattern_descriptor;
+
+
+LV2_SYMBOL_EXPORT
+    const LV2_Descriptor*
+lv2_descriptor(uint32_t index)
+{
+    switch (index) {
+        case 0:  return &arpeggiator_descriptor;
+        case 1:  return &midi_pattern_descriptor;
+        default: return NULL;
+    }
+}
@@ -1,34 +1,22 @@
 #include <math.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
-#include <lv2/lv2plug.in/ns/lv2core/lv2.h>
-#include <lv2/lv2plug.in/ns/ext/atom/atom.h>
-#include <lv2/lv2plug.in/ns/ext/atom/forge.h>
-#include <lv2/lv2plug.in/ns/ext/log/logger.h>
-#include <lv2/lv2plug.in/ns/ext/midi/midi.h>
-#include "lv2/lv2plug.in/ns/ext/time/time.h"
-#include <lv2/lv2plug.in/ns/ext/urid/urid.h>
+#include <lv2/lv2plug.in/ns/ext/patch/patch.h>
 
-#ifndef DEBUG
-#define DEBUG 0
-#endif
-#define debug_print(...) \
-    ((void)((DEBUG) ? fprintf(stderr, __VA_ARGS__) : 0))
+#include "bg-core.h"
 
 #define NUM_VOICES 16
+#define NUM_STEPS 8
+#define MAX_STEPS 256 // Longest pattern that can be loaded with patch:Set
+// The retrigger input fires when it rises above the high level and has to
+// fall below the low one before it can fire again, so a noisy edge counts once
+#define RETRIGGER_HIGH 0.5f
+#define RETRIGGER_LOW  0.25f
 #define PLUGIN_URI "http://bramgiesen.com/midi-pattern"
 
 
-// Struct for a 3 byte MIDI event
-typedef struct {
-    LV2_Atom_Event event;
-    uint8_t        msg[3];
-} LV2_Atom_MIDI;
-
-
 typedef enum {
     MIDI_IN                = 0,
     MIDI_OUT               = 1,
@@ -43,63 +31,77 @@ typedef enum {
     PATTERNVEL5            = 10,
     PATTERNVEL6            = 11,
     PATTERNVEL7            = 12,
-    PATTERNVEL8            = 13
+    PATTERNVEL8            = 13,
+    METRICS                = 14,
+    TRACE                  = 15
 } PortIndex;
 
 
+// URIDs for loading patterns, the clock ones are in ClockURIs
+typedef struct {
+    LV2_URID atom_Int;
+    LV2_URID atom_URID;
+    LV2_URID atom_Vector;
+    LV2_URID patch_Set;
+    LV2_URID patch_property;
+    LV2_URID patch_value;
+    LV2_URID pattern;
+} PatchURIs;
+
+// Control port values, read once at the start of every run()
+typedef struct {
+    int       sync;
+    float     divisions;
+    size_t    pattern_length;
+    uint8_t   velocities[NUM_STEPS];
+    bool      trace;
+} PatternParams;
+
+// Step velocities loaded with a patch:Set message, a length of 0 means the
+// velocity control ports are used
 typedef struct {
-    LV2_URID atom_Blank;
-    LV2_URID atom_Float;
-    LV2_URID atom_Object;
-    LV2_URID atom_Path;
-    LV2_URID atom_Resource;
-    LV2_URID atom_Sequence;
-    LV2_URID time_Position;
-    LV2_URID time_barBeat;
-    LV2_URID time_beatsPerMinute;
-    LV2_URID time_speed;
-} ClockURIs;
+    uint8_t   velocities[MAX_STEPS];
+    size_t    length;
+} Pattern;
 
 typedef struct {
 
-    LV2_URID_Map*          map; // URID map feature
-    LV2_Log_Log* 	       log;
+    HostFeatures          host;
     LV2_Log_Logger      logger; // Logger API
     ClockURIs             uris; // Cache of mapped URIDs
-
-    // URIDs
-    LV2_URID urid_midiEvent;
+    PatchURIs       patch_uris;
+    MetricsURIs   metrics_uris;
+    LV2_Atom_Forge       forge;
 
     const LV2_Atom_Sequence* MIDI_in;
     LV2_Atom_Sequence*       MIDI_out;
+    LV2_Atom_Sequence*       metrics_out;
 
-    float     divisions;
+    PatternParams params;
+    bool      params_valid;
     double    samplerate;
-    int       prevSync;
 
-    // Variables to keep track of the tempo information sent by the host
-    float     bpm; // Beats per minute (tempo)
+    // Tempo information sent by the host
+    Transport transport;
     uint32_t  pos;
     uint32_t  period;
     uint32_t  h_wavelength;
     size_t    pattern_index;
-    size_t    prev_cv_retrigger;
-    int       octave_index;
+    // The playing pattern and the one a message was loaded into. They swap at
+    // the next step, so a pattern never changes in the middle of a step.
+    Pattern   patterns[2];
+    unsigned  active_pattern;
+    bool      pattern_pending;
+    bool      retrigger_high; // The retrigger input is above its threshold
+    uint32_t  retrigger_frame; // Next rising edge of the retrigger input in the block
     bool      triggered;
-    float     speed; // Transport speed (usually 0=stop, 1=play)
     float     prev_speed;
-    float     beat_in_measure;
-    uint8_t   current_velocity;
-    float   **velocity_pattern[8];
-
-    float 	  elapsed_len; // Frames since the start of the last click
-    uint32_t  wave_offset; // Current play offset in the wave
+    uint64_t  frame_count; // Frames processed since activation
+    OutQueue  out_queue;
+    Metrics   metrics;
+    TraceRing trace;
+    float   **velocity_pattern[NUM_STEPS];
 
-    // Envelope parameters
-    uint32_t  attack_len;
-    uint32_t  decay_len;
-
-    float*    change_bpm;
     float*    changed_div;
     float*    cv_retrigger;
     float*    sync;
@@ -112,24 +114,25 @@ typedef struct {
     float*    pattern_vel6_param;
     float*    pattern_vel7_param;
     float*    pattern_vel8_param;
+    float*    trace_port;
 } MidiPattern;
 
 
-
-static LV2_Atom_MIDI
-createMidiEvent(MidiPattern* self, uint8_t status, uint8_t note, uint8_t velocity)
+static bool
+createMidiEvent(MidiPattern* self, uint32_t frame, uint8_t status, uint8_t note, uint8_t velocity)
 {
-    LV2_Atom_MIDI msg;
-    memset(&msg, 0, sizeof(LV2_Atom_MIDI));
-
-    msg.event.body.size = 3;
-    msg.event.body.type = self->urid_midiEvent;
+    const uint8_t msg[3] = { status, note, velocity };
 
-    msg.msg[0] = status;
-    msg.msg[1] = note;
-    msg.msg[2] = velocity;
+    if (!outQueuePush(&self->out_queue, frame, msg, 3)) {
+        return false;
+    }
+    if (isNoteOff(msg, 3)) {
+        traceWrite(&self->trace, self->frame_count + frame, TRACE_NOTE_OFF, 0, note, velocity);
+    } else if ((status & 0xF0) == LV2_MIDI_MSG_NOTE_ON) {
+        traceWrite(&self->trace, self->frame_count + frame, TRACE_NOTE_ON, 0, note, velocity);
+    }
 
-    return msg;
+    return true;
 }
 
 
@@ -184,6 +187,12 @@ connect_port(LV2_Handle instance,
         case PATTERNVEL8:
             self->pattern_vel8_param = (float*)data;
             break;
+        case METRICS:
+            self->metrics_out = (LV2_Atom_Sequence*)data;
+            break;
+        case TRACE:
+            self->trace_port = (float*)data;
+            break;
     }
 }
 
@@ -193,7 +202,12 @@ static void
 activate(LV2_Handle instance)
 {
     MidiPattern* self = (MidiPattern*)instance;
-    self->divisions =*self->changed_div;
+    self->params_valid = false;
+    self->frame_count = 0;
+    transportReset(&self->transport);
+    self->retrigger_high = false;
+    outQueueClear(&self->out_queue);
+    memset(&self->metrics, 0, sizeof(Metrics));
 }
 
 
@@ -211,51 +225,38 @@ instantiate(const LV2_Descriptor*     descriptor,
         return NULL;
     }
 
-    for (uint32_t i=0; features[i]; ++i)
-    {
-        if (!strcmp (features[i]->URI, LV2_URID__map))
-        {
-            self->map = (LV2_URID_Map*)features[i]->data;
-        }
-        else if (!strcmp (features[i]->URI, LV2_LOG__log))
-        {
-            self->log = (LV2_Log_Log*)features[i]->data;
-        }
-    }
-
-    lv2_log_logger_init (&self->logger, self->map, self->log);
+    hostFeaturesGet(&self->host, features);
+    lv2_log_logger_init (&self->logger, self->host.map, self->host.log);
 
-    if (!self->map) {
+    if (!self->host.map) {
         lv2_log_error (&self->logger, "midi-pattern.lv2 error: Host does not support urid:map\n");
         free (self);
         return NULL;
     }
 
     // Map URIS
-    ClockURIs* const    uris  = &self->uris;
-    LV2_URID_Map* const map   = self->map;
-    self->urid_midiEvent      = map->map(map->handle, LV2_MIDI__MidiEvent);
-    uris->atom_Blank          = map->map(map->handle, LV2_ATOM__Blank);
-    uris->atom_Float          = map->map(map->handle, LV2_ATOM__Float);
-    uris->atom_Object         = map->map(map->handle, LV2_ATOM__Object);
-    uris->atom_Path           = map->map(map->handle, LV2_ATOM__Path);
-    uris->atom_Resource       = map->map(map->handle, LV2_ATOM__Resource);
-    uris->atom_Sequence       = map->map(map->handle, LV2_ATOM__Sequence);
-    uris->time_Position       = map->map(map->handle, LV2_TIME__Position);
-    uris->time_barBeat        = map->map(map->handle, LV2_TIME__barBeat);
-    uris->time_beatsPerMinute = map->map(map->handle, LV2_TIME__beatsPerMinute);
-    uris->time_speed          = map->map(map->handle, LV2_TIME__speed);
-
-    debug_print("DEBUGING");
+    PatchURIs* const    uris  = &self->patch_uris;
+    LV2_URID_Map* const map   = self->host.map;
+    clockURIsMap(&self->uris, map);
+    uris->atom_Int            = map->map(map->handle, LV2_ATOM__Int);
+    uris->atom_URID           = map->map(map->handle, LV2_ATOM__URID);
+    uris->atom_Vector         = map->map(map->handle, LV2_ATOM__Vector);
+    uris->patch_Set           = map->map(map->handle, LV2_PATCH__Set);
+    uris->patch_property      = map->map(map->handle, LV2_PATCH__property);
+    uris->patch_value         = map->map(map->handle, LV2_PATCH__value);
+    uris->pattern             = map->map(map->handle, PLUGIN_URI "#pattern");
+    metricsURIsMap(&self->metrics_uris, map, PLUGIN_URI);
+    lv2_atom_forge_init(&self->forge, map);
+
     self->samplerate = rate;
-    self->prevSync   = 0;
-    self->beat_in_measure = 0;
+    self->transport.beat_in_measure = 0;
+    // Rolling until the host says otherwise
+    self->transport.speed = 1;
     self->prev_speed = 0;
     self->pattern_index = 0;
     self->triggered = false;
-    self->pattern_index = 0;
-    self->current_velocity = 0;
     self->pos = 0;
+    outQueueClear(&self->out_queue);
 
     self->velocity_pattern[0]  = &self->pattern_vel1_param;
     self->velocity_pattern[1]  = &self->pattern_vel2_param;
@@ -272,48 +273,378 @@ instantiate(const LV2_Descriptor*     descriptor,
 
 
 
+// Frames since the start of the bar of the host transport at a frame of the
+// current block, extrapolated from the last beat position the host sent
+static double
+hostPosition(MidiPattern* self, uint32_t frame)
+{
+    const Transport* transport = &self->transport;
+    const double beat_frames = self->samplerate * (60.0f / transport->bpm) * transport->beat_in_measure
+        + transportElapsed(transport, self->frame_count + frame);
+
+    return (beat_frames > 0.0) ? beat_frames : 0.0;
+}
+
+
+// Position in the period of the host transport at a frame of the current
+// block
+static uint32_t
+resetPhase(MidiPattern* self, uint32_t frame)
+{
+    if (self->period == 0) {
+        return 0;
+    }
+
+    return (uint32_t)fmod(hostPosition(self, frame), self->period);
+}
+
+
+// Follow the host when its position no longer matches ours, e.g. after a
+// relocation. Differences within the rounding of the host's beat position
+// are ignored. Only a correction into the next step moves the pattern on;
+// when the host is still in the previous step, the step that played early
+// waits at its start instead of playing twice.
 static void
-update_position(MidiPattern* self, const LV2_Atom_Object* obj)
+syncPhase(MidiPattern* self, uint32_t frame)
 {
-    const ClockURIs* uris = &self->uris;
+    if (self->period == 0) {
+        return;
+    }
+
+    const int64_t period = self->period;
+    const int64_t tolerance = (int64_t)transportTolerance(&self->transport, self->samplerate);
+    const uint32_t host_pos = resetPhase(self, frame);
+    // A step that starts here has not played yet
+    const bool wrapped = self->pos >= self->period;
+    const uint32_t pos = wrapped ? 0 : self->pos;
+    int64_t diff = (int64_t)host_pos - pos;
+
+    diff = (diff > period / 2) ? diff - period : (diff < -period / 2) ? diff + period : diff;
+
+    if (llabs(diff) <= tolerance) {
+        return;
+    }
+    if (pos + diff >= period) {
+        self->pos = host_pos;
+        self->triggered = false;
+    } else if (pos + diff < 0) {
+        self->pos = wrapped ? host_pos : 0;
+    } else {
+        // Back from the second half the step has played already
+        self->triggered = self->triggered || (pos > self->h_wavelength && host_pos < self->h_wavelength);
+        self->pos = host_pos;
+    }
+    traceWrite(&self->trace, self->frame_count + frame, TRACE_PHASE_RESET, self->pos, 0, 0);
+}
+
+
+// Load the velocities of a patch:Set message into the pattern that is not
+// playing. An empty vector switches back to the control ports.
+static void
+loadPattern(MidiPattern* self, const LV2_Atom_Object* obj)
+{
+    const PatchURIs* uris = &self->patch_uris;
+    const LV2_Atom* property = NULL;
+    const LV2_Atom* value = NULL;
 
-    // Received new transport position/speed
-    LV2_Atom *beat = NULL, *bpm = NULL, *speed = NULL;
     lv2_atom_object_get(obj,
-            uris->time_barBeat, &beat,
-            uris->time_beatsPerMinute, &bpm,
-            uris->time_speed, &speed,
+            uris->patch_property, &property,
+            uris->patch_value, &value,
             NULL);
-    if (bpm && bpm->type == uris->atom_Float)
-    {
-        // Tempo changed, update BPM
-        self->bpm = ((LV2_Atom_Float*)bpm)->body;
+    if (!property || property->type != uris->atom_URID
+            || ((const LV2_Atom_URID*)property)->body != uris->pattern
+            || !value || value->type != uris->atom_Vector
+            || value->size < sizeof(LV2_Atom_Vector_Body)) {
+        return;
     }
-    if (speed && speed->type == uris->atom_Float)
-    {
-        // Speed changed, e.g. 0 (stop) to 1 (play)
-        self->speed = ((LV2_Atom_Float*)speed)->body;
+
+    const LV2_Atom_Vector* vector = (const LV2_Atom_Vector*)value;
+    const uint32_t child_type = vector->body.child_type;
+    const uint32_t values_size = value->size - sizeof(LV2_Atom_Vector_Body);
+
+    // The elements have to fill the atom exactly, anything else is malformed
+    if ((child_type != uris->atom_Int && child_type != self->uris.atom_Float)
+            || vector->body.child_size != sizeof(int32_t)
+            || values_size % sizeof(int32_t) != 0) {
+        return;
     }
-    if (beat && beat->type == uris->atom_Float)
-    {
-        // Received a beat position, synchronise
-        // This hard sync may cause clicks, a real plugin would be more graceful
-        const float frames_per_beat = (self->samplerate * (60.0f / (self->bpm * self->divisions)));
-        const float bar_beats       = (((LV2_Atom_Float*)beat)->body * self->divisions);
-        const float beat_beats      = bar_beats - floorf(bar_beats);
-        self->beat_in_measure         = ((LV2_Atom_Float*)beat)->body; 
-        self->elapsed_len           = beat_beats * frames_per_beat;
+
+    Pattern* pattern = &self->patterns[!self->active_pattern];
+    const void* values = LV2_ATOM_BODY_CONST(&vector->atom) + sizeof(LV2_Atom_Vector_Body);
+    size_t length = values_size / sizeof(int32_t);
+
+    length = (length > MAX_STEPS) ? MAX_STEPS : length;
+
+    for (size_t i = 0; i < length; i++) {
+        float velocity = (child_type == uris->atom_Int) ? (float)((const int32_t*)values)[i]
+            : ((const float*)values)[i];
+        velocity = (velocity < 0) ? 0 : velocity;
+        velocity = (velocity > 127) ? 127 : velocity;
+        pattern->velocities[i] = (uint8_t)velocity;
     }
+    pattern->length = length;
+    self->pattern_pending = true;
 }
 
 
+static size_t
+patternLength(const MidiPattern* self)
+{
+    const Pattern* pattern = &self->patterns[self->active_pattern];
+
+    return (pattern->length > 0) ? pattern->length : self->params.pattern_length;
+}
+
 
+static uint8_t
+stepVelocity(const MidiPattern* self)
+{
+    const Pattern* pattern = &self->patterns[self->active_pattern];
+
+    return (pattern->length > 0) ? pattern->velocities[self->pattern_index]
+        : self->params.velocities[self->pattern_index];
+}
+
+
+// Move to the next step, or to the first step of a pattern that was loaded
+// since the previous one
+static void
+nextStep(MidiPattern* self, uint32_t frame)
+{
+    if (self->pattern_pending) {
+        self->active_pattern = !self->active_pattern;
+        self->pattern_pending = false;
+        self->pattern_index = 0;
+    } else {
+        self->pattern_index = (self->pattern_index + 1) % patternLength(self);
+    }
+    self->metrics.steps++;
+    traceWrite(&self->trace, self->frame_count + frame, TRACE_STEP, (uint32_t)self->pattern_index, 0, stepVelocity(self));
+}
+
+
+// The host jumped to another position, e.g. the start of a loop. The
+// position in the step and the step in the pattern are taken from the host,
+// as if the pattern had played from the start of the bar: like after a
+// start, every step moves the pattern on before it plays.
+static void
+relocate(MidiPattern* self, uint32_t frame)
+{
+    if (self->period == 0) {
+        return;
+    }
+
+    const double position = hostPosition(self, frame);
+    const uint64_t step = (uint64_t)(position / self->period);
+    const size_t length = patternLength(self);
+
+    self->pos = (uint32_t)fmod(position, self->period);
+    // In its first half the step is played right away
+    if (self->pos < self->h_wavelength) {
+        self->pattern_index = (size_t)(step % length);
+        self->triggered = false;
+    } else {
+        self->pattern_index = (size_t)((step + 1) % length);
+        self->triggered = true;
+    }
+    traceWrite(&self->trace, self->frame_count + frame, TRACE_PHASE_RESET, self->pos, 0, 0);
+}
+
+
+// Advance the pattern when a step starts at the current position. Calling it
+// again for the same position does nothing.
+static void
+updateStep(MidiPattern* self, uint32_t frame)
+{
+    const PatternParams* params = &self->params;
+
+    if(self->pos >= self->period) {
+        self->pos = 0;
+    }
+
+    // The pattern waits while the host transport is stopped
+    if (params->sync > 0 && self->transport.speed != 0) {
+        if((self->pos < self->h_wavelength && !self->triggered)) {
+            nextStep(self, frame);
+            self->triggered = true;
+        } else if (self->pos > self->h_wavelength) {
+            //set gate
+            self->triggered = false;
+        }
+    }
+}
+
+
+// Run the pattern clock over a part of the block. The step state can only
+// change where a step starts and halfway through it, so this jumps from one
+// of those points to the next instead of visiting every frame.
+static void
+stepPattern(MidiPattern* self, uint32_t start, uint32_t end)
+{
+    uint32_t frame = start;
+
+    if (self->period == 0) {
+        self->pos = 0;
+        return;
+    }
+    if (self->params.sync > 0 && self->transport.speed == 0) {
+        return;
+    }
+
+    // Without sync the steps follow the notes, the clock only has to keep its
+    // position: it wraps at every period that starts before the last frame
+    if (self->params.sync == 0) {
+        if (end > start) {
+            uint32_t pos = (self->pos >= self->period) ? 0 : self->pos;
+            pos += end - start;
+            self->pos = pos - (pos - 1) / self->period * self->period;
+        }
+        return;
+    }
+
+    while (frame < end) {
+        updateStep(self, frame);
+
+        const uint32_t next = (self->pos <= self->h_wavelength) ? self->h_wavelength + 1 : self->period;
+        const uint32_t frames = (next - self->pos < end - frame) ? next - self->pos : end - frame;
+
+        self->pos += frames;
+        frame += frames;
+    }
+}
+
+
+// First frame from start on where the CV is at or above a level, or end.
+// Only the maximum of each group of eight frames is compared, which the
+// compiler turns into vector instructions; the group with the crossing is
+// then searched frame by frame.
 static uint32_t
-resetPhase(MidiPattern* self)
+findAbove(const float* cv, uint32_t start, uint32_t end, float level)
 {
-    uint32_t pos = (uint32_t)fmod(self->samplerate * (60.0f / self->bpm) * self->beat_in_measure, (self->samplerate * (60.0f / (self->bpm * (self->divisions / 2.0f)))));
+    uint32_t i = start;
 
-    return pos;
+    for (; i + 8 <= end; i += 8) {
+        float max = cv[i];
+        for (unsigned k = 1; k < 8; k++) {
+            max = (cv[i + k] > max) ? cv[i + k] : max;
+        }
+        if (max >= level) {
+            break;
+        }
+    }
+    while (i < end && cv[i] < level) {
+        i++;
+    }
+
+    return i;
+}
+
+
+// First frame from start on where the CV is below a level, or end
+static uint32_t
+findBelow(const float* cv, uint32_t start, uint32_t end, float level)
+{
+    uint32_t i = start;
+
+    for (; i + 8 <= end; i += 8) {
+        float min = cv[i];
+        for (unsigned k = 1; k < 8; k++) {
+            min = (cv[i + k] < min) ? cv[i + k] : min;
+        }
+        if (min < level) {
+            break;
+        }
+    }
+    while (i < end && cv[i] >= level) {
+        i++;
+    }
+
+    return i;
+}
+
+
+// Find the next rising edge of the retrigger input from a frame on, the
+// frame of the block end when there is none
+static void
+findRetrigger(MidiPattern* self, uint32_t frame, uint32_t n_samples)
+{
+    const float* cv = self->cv_retrigger;
+
+    if (self->retrigger_high) {
+        frame = findBelow(cv, frame, n_samples, RETRIGGER_LOW);
+        self->retrigger_high = frame == n_samples;
+    }
+    if (!self->retrigger_high) {
+        frame = findAbove(cv, frame, n_samples, RETRIGGER_HIGH);
+        self->retrigger_high = frame < n_samples;
+    }
+    self->retrigger_frame = frame;
+}
+
+
+// Run the pattern clock up to and including a frame of the block, starting
+// the pattern over at every rising edge of the retrigger input on the way
+static void
+runClock(MidiPattern* self, uint32_t start, uint32_t end, uint32_t n_samples)
+{
+    while (self->retrigger_frame <= end && self->retrigger_frame < n_samples) {
+        const uint32_t edge = self->retrigger_frame;
+
+        stepPattern(self, start, edge);
+        self->pattern_index = 0;
+        traceWrite(&self->trace, self->frame_count + edge, TRACE_RETRIGGER, 0, 0, 0);
+        start = edge;
+        findRetrigger(self, edge, n_samples);
+    }
+    stepPattern(self, start, end);
+}
+
+
+static void
+updatePeriod(MidiPattern* self)
+{
+    if (self->transport.bpm > 0) {
+        self->period = (uint32_t)(self->samplerate * (60.0f / (self->transport.bpm * (self->params.divisions / 2.0f))));
+    } else {
+        self->period = 0;
+    }
+    self->h_wavelength = (self->period/2.0f);
+}
+
+
+// Take a snapshot of the control ports, returns true when the sync mode or
+// the divisions changed
+static bool
+readParams(MidiPattern* self)
+{
+    PatternParams params;
+    bool changed;
+
+    params.sync           = (int)*self->sync;
+    params.divisions      = *self->changed_div;
+    params.pattern_length = (size_t)*self->velocity_pattern_length_param;
+    params.pattern_length = (params.pattern_length < 1) ? 1 : params.pattern_length;
+    params.pattern_length = (params.pattern_length > NUM_STEPS) ? NUM_STEPS : params.pattern_length;
+
+    for (unsigned i = 0; i < NUM_STEPS; i++) {
+        params.velocities[i] = (uint8_t)**self->velocity_pattern[i];
+    }
+    // Tracing needs the worker to drain the records
+    params.trace = self->host.schedule && self->trace_port && *self->trace_port == 1;
+
+    const bool sync_changed = !self->params_valid || params.sync != self->params.sync;
+
+    changed = sync_changed || params.divisions != self->params.divisions;
+
+    self->params = params;
+    self->params_valid = true;
+    self->trace.enabled = params.trace;
+
+    if (sync_changed) {
+        traceWrite(&self->trace, self->frame_count, TRACE_SYNC, (uint32_t)params.sync, 0, 0);
+    }
+
+    return changed;
 }
 
 
@@ -322,6 +653,7 @@ run(LV2_Handle instance, uint32_t n_samples)
 {
     MidiPattern* self = (MidiPattern*)instance;
     const ClockURIs* uris = &self->uris;
+    const uint64_t start_time = self->metrics_out ? monotonicTime() : 0;
 
     self->MIDI_out->atom.type = self->MIDI_in->atom.type;
 
@@ -330,85 +662,97 @@ run(LV2_Handle instance, uint32_t n_samples)
     // Write an empty Sequence header to the output
     lv2_atom_sequence_clear(self->MIDI_out);
 
-    // Read incoming events
+    const bool phase_changed = readParams(self);
+    const PatternParams* params = &self->params;
+    uint32_t offset = 0;
+
+    self->pattern_index = (self->pattern_index < patternLength(self)) ? self->pattern_index : 0;
+
+    //reset phase when sync is turned on or when there is a new division
+    if (phase_changed) {
+        updatePeriod(self);
+        self->pos = resetPhase(self, 0);
+        traceWrite(&self->trace, self->frame_count, TRACE_PHASE_RESET, self->pos, 0, 0);
+    }
+
+    findRetrigger(self, 0, n_samples);
+
+    // Read incoming events, running the pattern clock up to each one of them
     LV2_ATOM_SEQUENCE_FOREACH(self->MIDI_in, ev)
     {
+        uint32_t ev_frame = (ev->time.frames < n_samples) ? (uint32_t)ev->time.frames : n_samples;
+        ev_frame = (ev_frame < offset) ? offset : ev_frame;
+
+        runClock(self, offset, ev_frame, n_samples);
+        offset = ev_frame;
+
         if (ev->body.type == uris->atom_Object ||
                 ev->body.type == uris->atom_Blank) {
             const LV2_Atom_Object* obj = (const LV2_Atom_Object*)&ev->body;
             if (obj->body.otype == uris->time_Position) {
-                update_position(self, obj);
+                const float previous_bpm = self->transport.bpm;
+                const uint32_t update = transportUpdate(&self->transport, uris, obj, self->frame_count + ev_frame);
+                if (self->transport.bpm != previous_bpm) {
+                    updatePeriod(self);
+                }
+                //reset phase when playing starts or stops
+                if (self->transport.speed != self->prev_speed) {
+                    self->pos = resetPhase(self, ev_frame);
+                    self->prev_speed = self->transport.speed;
+                    // A start plays the step at the new position
+                    self->triggered = self->triggered && self->transport.speed == 0;
+                    traceWrite(&self->trace, self->frame_count + ev_frame, TRACE_PHASE_RESET, self->pos, 0, 0);
+                } else if ((update & TRANSPORT_BEAT) && params->sync > 0) {
+                    if ((update & TRANSPORT_RELOCATED) && self->transport.speed != 0) {
+                        relocate(self, ev_frame);
+                    } else {
+                        syncPhase(self, ev_frame);
+                    }
+                }
+            } else if (obj->body.otype == self->patch_uris.patch_Set) {
+                loadPattern(self, obj);
             }
         }
-        else if (ev->body.type == self->urid_midiEvent)
+        else if (ev->body.type == uris->midi_MidiEvent)
         {
             const uint8_t* const msg = (const uint8_t*)(ev + 1);
+            const uint32_t size = ev->body.size;
 
-            //const uint8_t channel = msg[0] & 0x0F;
-            const uint8_t status  = msg[0] & 0xF0;
-
-            uint8_t midi_note = msg[1];
-            uint8_t velocity = 0;
+            if (size == 0) {
+                continue;
+            }
 
-            switch (status)
-            {
-                case LV2_MIDI_MSG_NOTE_ON:
-                    velocity = self->current_velocity;
-                    if (*self->sync == 0) {
-                        self->pattern_index = (self->pattern_index + 1) % (uint8_t)*self->velocity_pattern_length_param;
-                    }
-                case LV2_MIDI_MSG_NOTE_OFF:
-                    break;
-                default:
-                    break;
+            self->metrics.events_in++;
+
+            // Only the velocity of a note-on is replaced by the step velocity,
+            // everything else, note-offs included, passes through untouched
+            if (size == 3 && (msg[0] & 0xF0) == LV2_MIDI_MSG_NOTE_ON && msg[2] > 0) {
+                // Take the velocity of the step at the note's own frame,
+                // including a step that starts at this very frame
+                updateStep(self, ev_frame);
+                createMidiEvent(self, ev_frame, msg[0], msg[1], stepVelocity(self));
+                if (params->sync == 0) {
+                    nextStep(self, ev_frame);
+                }
+            } else if (outQueuePush(&self->out_queue, ev_frame, msg, size) && isNoteOff(msg, size)) {
+                traceWrite(&self->trace, self->frame_count + ev_frame, TRACE_NOTE_OFF, 0, msg[1], msg[2]);
             }
-            LV2_Atom_MIDI midi_msg = createMidiEvent(self, status, midi_note, velocity);
-            lv2_atom_sequence_append_event(self->MIDI_out, out_capacity, (LV2_Atom_Event*)&midi_msg);
         }
     }
 
-    for(uint32_t i = 0; i < n_samples; i ++) {
-        //reset phase when playing starts or stops
-        if (self->speed != self->prev_speed) {
-            self->pos = resetPhase(self);
-            self->prev_speed = self->speed;
-        }
-        //reset phase when sync is turned on
-        if (*self->sync != self->prevSync) {
-            self->pos = resetPhase(self);
-            self->prevSync = *self->sync;
-        }
-        //reset phase when there is a new division
-        if (self->divisions != *self->changed_div) {
-            self->divisions = *self->changed_div;
-            self->pos = resetPhase(self);
-        }
-
-        if ((size_t)*self->cv_retrigger != self->prev_cv_retrigger) {
-            self->prev_cv_retrigger = (size_t)*self->cv_retrigger;
-            if (*self->cv_retrigger == 1) {
-                self->pattern_index = 0;
-            }
-        }
+    runClock(self, offset, n_samples, n_samples);
 
-        self->period = (uint32_t)(self->samplerate * (60.0f / (self->bpm * (self->divisions / 2.0f))));
-        self->h_wavelength = (self->period/2.0f);
+    const uint64_t deferred = self->out_queue.deferred;
+    const uint64_t dropped = self->out_queue.dropped;
 
-        if(self->pos >= self->period && i < n_samples) {
-            self->pos = 0;
-        }
+    self->metrics.events_out += outQueueFlush(&self->out_queue, self->MIDI_out, out_capacity, uris->midi_MidiEvent);
+    traceFlushCounts(&self->trace, &self->out_queue, self->frame_count + n_samples, deferred, dropped);
+    traceSchedule(&self->trace, self->host.schedule);
+    self->frame_count += n_samples;
 
-        if (*self->sync > 0) {
-            if((self->pos < self->h_wavelength && !self->triggered)) {
-                self->pattern_index = (self->pattern_index + 1) % (uint8_t)*self->velocity_pattern_length_param;
-                self->triggered = true;
-            } else if (self->pos > self->h_wavelength) {
-                //set gate
-                self->triggered = false;
-            }
-        }
-    self->current_velocity = (uint8_t)**self->velocity_pattern[self->pattern_index];
-    self->pos += 1;
+    if (self->metrics_out) {
+        metricsWrite(&self->metrics, &self->forge, self->metrics_out, &self->metrics_uris, &self->out_queue,
+                NULL, self->samplerate, n_samples, start_time);
     }
 }
 
@@ -425,13 +769,42 @@ cleanup(LV2_Handle instance)
     free(instance);
 }
 
+// Drain the trace outside of the audio thread
+static LV2_Worker_Status
+work(LV2_Handle                  instance,
+        LV2_Worker_Respond_Function respond,
+        LV2_Worker_Respond_Handle   handle,
+        uint32_t                    size,
+        const void*                 data)
+{
+    MidiPattern* self = (MidiPattern*)instance;
+
+    traceDrain(&self->trace, &self->logger, "midi-pattern");
+
+    return respond(handle, 0, NULL);
+}
+
+static LV2_Worker_Status
+work_response(LV2_Handle instance, uint32_t size, const void* data)
+{
+    ((MidiPattern*)instance)->trace.scheduled = false;
+
+    return LV2_WORKER_SUCCESS;
+}
+
 static const void*
 extension_data(const char* uri)
 {
+    static const LV2_Worker_Interface worker = { work, work_response, NULL };
+
+    if (!strcmp(uri, LV2_WORKER__interface)) {
+        return &worker;
+    }
+
     return NULL;
 }
 
-static const LV2_Descriptor descriptor = {
+const LV2_Descriptor midi_pattern_descriptor = {
     PLUGIN_URI,
     instantiate,
     connect_port,
@@ -441,14 +814,3 @@ static const LV2_Descriptor descriptor = {
     cleanup,
     extension_data
 };
-
-LV2_SYMBOL_EXPORT
-    const LV2_Descriptor*
-lv2_descriptor(uint32_t index)
-{
-    switch (index) {
-        case 0:  return &descriptor;
-        default: return NULL;
-    }
-}
-
@@ -0,0 +1,438 @@
+// Standalone JACK MIDI client running the arpeggiator.
+//
+// The arpeggiator engine is compiled into this program from the same source
+// as the plugin and driven through its LV2 descriptor, without a plugin
+// host. MIDI comes in and goes out through JACK MIDI ports, the gate is an
+// audio port and the JACK transport is passed on as time:Position, so the
+// host-sync modes follow it. Control values are given on the command line
+// or in config files.
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include <jack/jack.h>
+#include <jack/midiport.h>
+#include <jack/transport.h>
+
+#include <lv2/lv2plug.in/ns/lv2core/lv2.h>
+#include <lv2/lv2plug.in/ns/ext/atom/atom.h>
+#include <lv2/lv2plug.in/ns/ext/atom/forge.h>
+#include <lv2/lv2plug.in/ns/ext/midi/midi.h>
+#include "lv2/lv2plug.in/ns/ext/time/time.h"
+#include <lv2/lv2plug.in/ns/ext/urid/urid.h>
+
+#define MAX_URIDS     64
+#define ATOM_BUF_SIZE 65536
+#define CONFIG_LINE   256
+
+
+// The engine, linked in from bg-arpeggiator.c
+extern const LV2_Descriptor arpeggiator_descriptor;
+
+
+typedef enum {
+    PORT_MIDI_IN,
+    PORT_MIDI_OUT,
+    PORT_GATE,
+    PORT_CONTROL,
+    PORT_OPTIONAL
+} PortType;
+
+
+typedef struct {
+    PortType    type;
+    const char* symbol;
+    float       value;
+} PortInfo;
+
+
+// The ports of the arpeggiator in index order, with the defaults of its TTL
+static const PortInfo ports[] = {
+    { PORT_MIDI_IN, "MIDI_in", 0 }, { PORT_MIDI_OUT, "MIDI_out", 0 },
+    { PORT_GATE, "gate", 0 },
+    { PORT_CONTROL, "Bpm", 120 },
+    { PORT_CONTROL, "arpMode", 0 },
+    { PORT_CONTROL, "latchMode", 0 },
+    { PORT_CONTROL, "Divisions", 8 },
+    { PORT_CONTROL, "sync", 0 },
+    { PORT_CONTROL, "noteLength", 0.75 },
+    { PORT_CONTROL, "octaveSpread", 1 },
+    { PORT_CONTROL, "octaveMode", 0 },
+    { PORT_CONTROL, "velocity", 60 },
+    { PORT_CONTROL, "BYPASS", 1 },
+    { PORT_CONTROL, "seed", 0 },
+    { PORT_OPTIONAL, "metrics", 0 },
+    { PORT_CONTROL, "trace", 0 },
+};
+
+#define N_PORTS (sizeof(ports) / sizeof(ports[0]))
+
+
+typedef struct {
+    char*         uris[MAX_URIDS];
+    uint32_t      n_uris;
+    LV2_URID_Map  map;
+    LV2_Feature   map_feature;
+} UridMap;
+
+
+typedef struct {
+    jack_client_t*  client;
+    jack_port_t*    midi_in;
+    jack_port_t*    midi_out;
+    jack_port_t*    gate;
+    LV2_Handle      handle;
+    UridMap         urids;
+    LV2_Atom_Forge  forge;
+    LV2_URID        midi_MidiEvent;
+    LV2_URID        time_Position;
+    LV2_URID        time_barBeat;
+    LV2_URID        time_beatsPerMinute;
+    LV2_URID        time_frame;
+    LV2_URID        time_speed;
+    float           controls[N_PORTS];
+    bool            positioned; // A position was sent since activation
+    bool            rolling;
+    double          bpm;
+    jack_nframes_t  next_frame; // Transport frame expected in the next cycle
+    uint32_t        dropped; // Events that did not fit into a buffer
+    uint8_t         in_buf[ATOM_BUF_SIZE] __attribute__((aligned(8)));
+    uint8_t         out_buf[ATOM_BUF_SIZE] __attribute__((aligned(8)));
+} Client;
+
+
+static volatile sig_atomic_t running = 1;
+
+
+static LV2_URID
+map_uri(LV2_URID_Map_Handle handle, const char* uri)
+{
+    UridMap* urids = (UridMap*)handle;
+
+    for (uint32_t i = 0; i < urids->n_uris; i++) {
+        if (!strcmp(urids->uris[i], uri)) {
+            return i + 1;
+        }
+    }
+    if (urids->n_uris == MAX_URIDS) {
+        return 0;
+    }
+    urids->uris[urids->n_uris] = strdup(uri);
+
+    return ++urids->n_uris;
+}
+
+
+static void
+stop(int sig)
+{
+    running = 0;
+}
+
+
+static void
+shutdown_callback(void* arg)
+{
+    running = 0;
+}
+
+
+// Pass the JACK transport on as a host position when it started, stopped,
+// changed tempo or was relocated; in between the plugin follows it on its
+// own. Without a timebase master there is no tempo or beat, only whether the
+// transport is rolling.
+static void
+append_position(Client* c, jack_nframes_t n_frames)
+{
+    LV2_Atom_Forge_Frame object;
+    jack_position_t pos;
+    const jack_transport_state_t state = jack_transport_query(c->client, &pos);
+    const bool rolling = state == JackTransportRolling;
+    const double bpm = (pos.valid & JackPositionBBT) ? pos.beats_per_minute : 0.0;
+
+    if (c->positioned && rolling == c->rolling && bpm == c->bpm && pos.frame == c->next_frame) {
+        c->next_frame = rolling ? pos.frame + n_frames : pos.frame;
+        return;
+    }
+    c->positioned = true;
+    c->rolling = rolling;
+    c->bpm = bpm;
+    c->next_frame = rolling ? pos.frame + n_frames : pos.frame;
+
+    lv2_atom_forge_frame_time(&c->forge, 0);
+    lv2_atom_forge_object(&c->forge, &object, 0, c->time_Position);
+    // The frame lets the arpeggiator tell a relocation from a tempo change
+    lv2_atom_forge_key(&c->forge, c->time_frame);
+    lv2_atom_forge_long(&c->forge, (int64_t)pos.frame);
+    if (pos.valid & JackPositionBBT) {
+        lv2_atom_forge_key(&c->forge, c->time_beatsPerMinute);
+        lv2_atom_forge_float(&c->forge, (float)pos.beats_per_minute);
+        // JACK counts beats from 1, LV2 from 0
+        lv2_atom_forge_key(&c->forge, c->time_barBeat);
+        lv2_atom_forge_float(&c->forge, (float)(pos.beat - 1 + pos.tick / pos.ticks_per_beat));
+    }
+    lv2_atom_forge_key(&c->forge, c->time_speed);
+    lv2_atom_forge_float(&c->forge, rolling ? 1.0f : 0.0f);
+    lv2_atom_forge_pop(&c->forge, &object);
+}
+
+
+static int
+process(jack_nframes_t n_frames, void* arg)
+{
+    Client* c = (Client*)arg;
+    void* midi_in = jack_port_get_buffer(c->midi_in, n_frames);
+    void* midi_out = jack_port_get_buffer(c->midi_out, n_frames);
+    const jack_nframes_t n_events = jack_midi_get_event_count(midi_in);
+    LV2_Atom_Forge_Frame seq;
+
+    lv2_atom_forge_set_buffer(&c->forge, c->in_buf, sizeof(c->in_buf));
+    lv2_atom_forge_sequence_head(&c->forge, &seq, 0);
+    append_position(c, n_frames);
+
+    for (jack_nframes_t i = 0; i < n_events; i++) {
+        jack_midi_event_t event;
+
+        if (jack_midi_event_get(&event, midi_in, i) != 0) {
+            continue;
+        }
+        if (!lv2_atom_forge_frame_time(&c->forge, event.time)
+                || !lv2_atom_forge_atom(&c->forge, (uint32_t)event.size, c->midi_MidiEvent)
+                || !lv2_atom_forge_write(&c->forge, event.buffer, (uint32_t)event.size)) {
+            c->dropped++;
+            break;
+        }
+    }
+    lv2_atom_forge_pop(&c->forge, &seq);
+
+    LV2_Atom_Sequence* out_seq = (LV2_Atom_Sequence*)c->out_buf;
+    out_seq->atom.type = 0;
+    out_seq->atom.size = sizeof(c->out_buf) - sizeof(LV2_Atom);
+
+    arpeggiator_descriptor.connect_port(c->handle, 2, jack_port_get_buffer(c->gate, n_frames));
+    arpeggiator_descriptor.run(c->handle, n_frames);
+
+    jack_midi_clear_buffer(midi_out);
+    LV2_ATOM_SEQUENCE_FOREACH(out_seq, ev) {
+        if (ev->body.type == c->midi_MidiEvent
+                && jack_midi_event_write(midi_out, (jack_nframes_t)ev->time.frames,
+                        (const jack_midi_data_t*)(ev + 1), ev->body.size) != 0) {
+            c->dropped++;
+        }
+    }
+
+    return 0;
+}
+
+
+static bool
+set_control(Client* c, const char* setting)
+{
+    const char* equals = strchr(setting, '=');
+
+    if (!equals) {
+        return false;
+    }
+    for (uint32_t p = 0; p < N_PORTS; p++) {
+        if (ports[p].type == PORT_CONTROL
+                && strlen(ports[p].symbol) == (size_t)(equals - setting)
+                && !strncmp(ports[p].symbol, setting, (size_t)(equals - setting))) {
+            c->controls[p] = (float)atof(equals + 1);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+// Read SYMBOL=VALUE settings from a file, one per line. Blank lines and
+// lines starting with # are skipped, spaces are ignored.
+static bool
+read_config(Client* c, const char* path)
+{
+    FILE* file = fopen(path, "r");
+    char line[CONFIG_LINE];
+    unsigned number = 0;
+    bool ok = true;
+
+    if (!file) {
+        perror(path);
+        return false;
+    }
+    while (ok && fgets(line, sizeof(line), file)) {
+        char setting[CONFIG_LINE];
+        size_t n = 0;
+
+        number++;
+        for (const char* p = line; *p && *p != '\n'; p++) {
+            if (*p != ' ' && *p != '\t' && *p != '\r') {
+                setting[n++] = *p;
+            }
+        }
+        setting[n] = '\0';
+        if (n == 0 || setting[0] == '#') {
+            continue;
+        }
+        if (!set_control(c, setting)) {
+            fprintf(stderr, "%s:%u: unknown control setting %s\n", path, number, setting);
+            ok = false;
+        }
+    }
+    fclose(file);
+
+    return ok;
+}
+
+
+static void
+usage(const char* name)
+{
+    fprintf(stderr,
+            "Usage: %s [-n NAME] [-f FILE]... [SYMBOL=VALUE]...\n"
+            "  -n  JACK client name (default arpeggiator)\n"
+            "  -f  read SYMBOL=VALUE settings from a file, one per line\n"
+            "Settings on the command line override the ones from files\n", name);
+}
+
+
+int
+main(int argc, char** argv)
+{
+    const char* name = "arpeggiator";
+    const char* configs[16];
+    uint32_t n_configs = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:f:h")) != -1) {
+        switch (opt)
+        {
+            case 'n':
+                name = optarg;
+                break;
+            case 'f':
+                if (n_configs == sizeof(configs) / sizeof(configs[0])) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                configs[n_configs++] = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    Client* c = (Client*)calloc(1, sizeof(Client));
+    if (!c) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (uint32_t p = 0; p < N_PORTS; p++) {
+        c->controls[p] = ports[p].value;
+    }
+    for (uint32_t i = 0; i < n_configs; i++) {
+        if (!read_config(c, configs[i])) {
+            return 1;
+        }
+    }
+    for (int a = optind; a < argc; a++) {
+        if (!set_control(c, argv[a])) {
+            fprintf(stderr, "unknown control setting %s\n", argv[a]);
+            return 1;
+        }
+    }
+
+    c->client = jack_client_open(name, JackNoStartServer, NULL);
+    if (!c->client) {
+        fprintf(stderr, "cannot connect to the JACK server\n");
+        return 1;
+    }
+
+    c->urids.map.handle = &c->urids;
+    c->urids.map.map = map_uri;
+    c->urids.map_feature.URI = LV2_URID__map;
+    c->urids.map_feature.data = &c->urids.map;
+    c->midi_MidiEvent = map_uri(&c->urids, LV2_MIDI__MidiEvent);
+    c->time_Position = map_uri(&c->urids, LV2_TIME__Position);
+    c->time_barBeat = map_uri(&c->urids, LV2_TIME__barBeat);
+    c->time_beatsPerMinute = map_uri(&c->urids, LV2_TIME__beatsPerMinute);
+    c->time_frame = map_uri(&c->urids, LV2_TIME__frame);
+    c->time_speed = map_uri(&c->urids, LV2_TIME__speed);
+    lv2_atom_forge_init(&c->forge, &c->urids.map);
+
+    const LV2_Feature* features[] = { &c->urids.map_feature, NULL };
+    c->handle = arpeggiator_descriptor.instantiate(&arpeggiator_descriptor,
+            jack_get_sample_rate(c->client), "", features);
+    if (!c->handle) {
+        fprintf(stderr, "cannot instantiate the arpeggiator\n");
+        jack_client_close(c->client);
+        return 1;
+    }
+
+    // The gate buffer is connected in every cycle, JACK owns it
+    for (uint32_t p = 0; p < N_PORTS; p++) {
+        switch (ports[p].type)
+        {
+            case PORT_MIDI_IN:
+                arpeggiator_descriptor.connect_port(c->handle, p, c->in_buf);
+                break;
+            case PORT_MIDI_OUT:
+                arpeggiator_descriptor.connect_port(c->handle, p, c->out_buf);
+                break;
+            case PORT_CONTROL:
+                arpeggiator_descriptor.connect_port(c->handle, p, &c->controls[p]);
+                break;
+            case PORT_GATE:
+            case PORT_OPTIONAL:
+                arpeggiator_descriptor.connect_port(c->handle, p, NULL);
+                break;
+        }
+    }
+
+    c->midi_in = jack_port_register(c->client, "midi_in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
+    c->midi_out = jack_port_register(c->client, "midi_out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
+    c->gate = jack_port_register(c->client, "gate", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+    if (!c->midi_in || !c->midi_out || !c->gate) {
+        fprintf(stderr, "cannot register the JACK ports\n");
+        arpeggiator_descriptor.cleanup(c->handle);
+        jack_client_close(c->client);
+        return 1;
+    }
+
+    jack_set_process_callback(c->client, process, c);
+    jack_on_shutdown(c->client, shutdown_callback, NULL);
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    arpeggiator_descriptor.activate(c->handle);
+    if (jack_activate(c->client) != 0) {
+        fprintf(stderr, "cannot activate the JACK client\n");
+        arpeggiator_descriptor.cleanup(c->handle);
+        jack_client_close(c->client);
+        return 1;
+    }
+
+    while (running) {
+        sleep(1);
+    }
+
+    jack_deactivate(c->client);
+    arpeggiator_descriptor.deactivate(c->handle);
+    arpeggiator_descriptor.cleanup(c->handle);
+    jack_client_close(c->client);
+
+    if (c->dropped > 0) {
+        fprintf(stderr, "%u MIDI events dropped\n", c->dropped);
+    }
+    for (uint32_t i = 0; i < c->urids.n_uris; i++) {
+        free(c->urids.uris[i]);
+    }
+    free(c);
+
+    return 0;
+}
@@ -0,0 +1,1244 @@
+// Headless benchmark host for the arpeggiator and midi-pattern plugins.
+//
+// Loads the plugin binaries directly, maps URIDs itself and feeds run() with
+// synthetic input sequences, reporting the time spent in run() per block,
+// per sample and the number of MIDI events generated per second.
+//
+// With -c it checks instead that run() stays real-time safe: the host
+// defines the allocator, the mutex and semaphore functions, stdio, the libc
+// random number generator (it takes a lock) and a few blocking system calls
+// itself, so calls from the plugins end up in the versions below and are
+// counted when they happen inside run(). The host runs the worker of the
+// plugins itself between two blocks, so the trace scenario covers the trace
+// records and their hand over to the worker. Every combination of the swept
+// controls is run with a normal and with a tiny output buffer, and the output
+// with a host that rounds its positions to ticks like JACK has to match the
+// output with exact positions.
+//
+// With -t it runs the same combinations and prints the MIDI output and the
+// gate CV changes of every run instead. All input is deterministic, so
+// traces from before and after a change can be compared with diff, and make
+// check compares it with the trace committed next to this file.
+
+#define _GNU_SOURCE
+// The fortified stdio wrappers would clash with the definitions below
+#undef _FORTIFY_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <lv2/lv2plug.in/ns/lv2core/lv2.h>
+#include <lv2/lv2plug.in/ns/ext/atom/atom.h>
+#include <lv2/lv2plug.in/ns/ext/atom/forge.h>
+#include <lv2/lv2plug.in/ns/ext/log/log.h>
+#include <lv2/lv2plug.in/ns/ext/midi/midi.h>
+#include "lv2/lv2plug.in/ns/ext/time/time.h"
+#include <lv2/lv2plug.in/ns/ext/urid/urid.h>
+#include <lv2/lv2plug.in/ns/ext/worker/worker.h>
+
+#define MAX_PORTS     32
+#define MAX_URIDS     256
+#define MAX_SIZES     8
+#define MAX_INSTANCES 256
+#define ATOM_BUF_SIZE 16384
+// Output capacity for the overflow runs of the check, room for two events
+#define SMALL_OUT_SIZE 56
+// Resolution of the rounded host positions, the ticks of JACK
+#define HOST_TICKS_PER_BEAT 1920
+
+
+typedef enum {
+    PORT_ATOM_IN,
+    PORT_ATOM_OUT,
+    PORT_METRICS_OUT,
+    PORT_CV_IN,
+    PORT_CV_OUT,
+    PORT_CONTROL
+} PortType;
+
+
+typedef struct {
+    PortType  type;
+    float     value;
+} PortInfo;
+
+
+// A control port that is stepped through its values in the chord scenario,
+// optionally setting a second port the first one depends on (-1 for none).
+// The change scenario moves it on to its next value during the run.
+typedef struct {
+    const char* name;
+    uint32_t    port;
+    uint32_t    n_values;
+    float       values[8];
+    int32_t     extra_port;
+    float       extra_value;
+} Sweep;
+
+
+typedef struct {
+    const char* uri;
+    const char* name;
+    uint32_t    sync_port;
+    uint32_t    trace_port;
+    uint32_t    n_ports;
+    PortInfo    ports[MAX_PORTS];
+    uint32_t    n_sweeps;
+    Sweep       sweeps[4];
+} PluginInfo;
+
+
+static const PluginInfo plugins[] = {
+    {
+        "http://bramgiesen.com/arpeggiator", "arpeggiator", 7, 15, 16,
+        {
+            { PORT_ATOM_IN, 0 }, { PORT_ATOM_OUT, 0 }, { PORT_CV_OUT, 0 },
+            { PORT_CONTROL, 120 },  // Bpm
+            { PORT_CONTROL, 0 },    // arpMode
+            { PORT_CONTROL, 0 },    // latchMode
+            { PORT_CONTROL, 8 },    // Divisions
+            { PORT_CONTROL, 0 },    // sync
+            { PORT_CONTROL, 0.75 }, // noteLength
+            { PORT_CONTROL, 1 },    // octaveSpread
+            { PORT_CONTROL, 0 },    // octaveMode
+            { PORT_CONTROL, 60 },   // velocity
+            { PORT_CONTROL, 1 },    // BYPASS
+            { PORT_CONTROL, 1 },    // seed
+            { PORT_METRICS_OUT, 0 },
+            { PORT_CONTROL, 0 },    // trace
+        },
+        4,
+        {
+            { "arpMode",    4, 7, { 0, 1, 2, 3, 4, 5, 6 }, -1, 0 },
+            { "octaveMode", 10, 4, { 0, 1, 2, 3 }, 9, 3 }, // octaveSpread
+            { "latchMode",  5, 2, { 0, 1 }, -1, 0 },
+            { "sync",       7, 3, { 0, 1, 2 }, -1, 0 },
+        }
+    },
+    {
+        "http://bramgiesen.com/midi-pattern", "midi-pattern", 3, 15, 16,
+        {
+            { PORT_ATOM_IN, 0 }, { PORT_ATOM_OUT, 0 }, { PORT_CV_IN, 0 },
+            { PORT_CONTROL, 1 },    // sync
+            { PORT_CONTROL, 8 },    // Divisions
+            { PORT_CONTROL, 8 },    // patternlength
+            { PORT_CONTROL, 127 }, { PORT_CONTROL, 30 }, { PORT_CONTROL, 90 }, { PORT_CONTROL, 30 },
+            { PORT_CONTROL, 110 }, { PORT_CONTROL, 30 }, { PORT_CONTROL, 90 }, { PORT_CONTROL, 60 },
+            { PORT_METRICS_OUT, 0 },
+            { PORT_CONTROL, 0 },    // trace
+        },
+        1,
+        {
+            { "sync", 3, 2, { 0, 1 }, -1, 0 },
+        }
+    },
+};
+
+
+typedef enum {
+    SCENARIO_IDLE,
+    SCENARIO_CHORD,
+    SCENARIO_FLOOD,
+    SCENARIO_TEMPO,
+    SCENARIO_CHANGE,
+    SCENARIO_STEADY,
+    SCENARIO_ROUNDED,
+    SCENARIO_TRACE
+} ScenarioType;
+
+
+static const char* scenario_names[] = {
+    "idle", "chord", "flood", "tempo", "change", "steady", "rounded", "trace"
+};
+
+
+typedef struct {
+    LV2_Handle      handle;
+    float           controls[MAX_PORTS];
+    float*          cv;
+    LV2_Atom_Forge  forge;
+    uint8_t         in_buf[ATOM_BUF_SIZE] __attribute__((aligned(8)));
+    uint8_t         out_buf[ATOM_BUF_SIZE] __attribute__((aligned(8)));
+    uint8_t         metrics_buf[ATOM_BUF_SIZE] __attribute__((aligned(8)));
+    uint32_t        rng;
+    bool            held[128];
+    double          beat;
+    float           gate;
+
+    // Worker requests are run by the host after the block
+    LV2_Worker_Schedule schedule;
+    LV2_Feature     schedule_feature;
+    const LV2_Worker_Interface* worker;
+    bool            work_pending;
+    bool            response_pending;
+} Instance;
+
+
+typedef struct {
+    char*           uris[MAX_URIDS];
+    uint32_t        n_uris;
+    LV2_URID_Map    map;
+    LV2_Feature     map_feature;
+    LV2_Log_Log     log;
+    LV2_Feature     log_feature;
+    uint64_t        trace_records; // Trace lines the plugins logged
+
+    LV2_URID        midi_MidiEvent;
+    LV2_URID        time_Position;
+    LV2_URID        time_barBeat;
+    LV2_URID        time_beatsPerMinute;
+    LV2_URID        time_speed;
+    LV2_URID        log_Trace;
+
+    double          samplerate;
+    double          seconds;
+} Host;
+
+
+// Outcome of running one scenario
+typedef struct {
+    double          ns_per_block;
+    double          events_per_second;
+    uint64_t        rt_calls;
+    const char*     rt_first_call;
+    uint32_t        output_hash;
+    uint64_t        trace_records;
+} Result;
+
+
+static bool         in_run;
+static uint64_t     rt_calls;
+static const char*  rt_first_call;
+
+static int     (*real_pthread_mutex_lock)(pthread_mutex_t*);
+static int     (*real_pthread_mutex_trylock)(pthread_mutex_t*);
+static int     (*real_pthread_cond_wait)(pthread_cond_t*, pthread_mutex_t*);
+static int     (*real_sem_wait)(sem_t*);
+static ssize_t (*real_read)(int, void*, size_t);
+static ssize_t (*real_write)(int, const void*, size_t);
+static int     (*real_open)(const char*, int, ...);
+static void*   (*real_mmap)(void*, size_t, int, int, int, off_t);
+static int     (*real_nanosleep)(const struct timespec*, struct timespec*);
+static int     (*real_clock_nanosleep)(clockid_t, int, const struct timespec*, struct timespec*);
+static int     (*real_usleep)(useconds_t);
+static long    (*real_random)(void);
+static int     (*real_rand)(void);
+static void    (*real_srand)(unsigned);
+static FILE*   (*real_fopen)(const char*, const char*);
+static int     (*real_fputs)(const char*, FILE*);
+static int     (*real_fputc)(int, FILE*);
+static int     (*real_puts)(const char*);
+static size_t  (*real_fwrite)(const void*, size_t, size_t, FILE*);
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+extern void  __libc_free(void* ptr);
+
+
+static void
+rt_call(const char* name)
+{
+    if (in_run && rt_calls++ == 0) {
+        rt_first_call = name;
+    }
+}
+
+
+static void
+rt_init(void)
+{
+    real_pthread_mutex_lock = dlsym(RTLD_NEXT, "pthread_mutex_lock");
+    real_pthread_mutex_trylock = dlsym(RTLD_NEXT, "pthread_mutex_trylock");
+    real_pthread_cond_wait = dlsym(RTLD_NEXT, "pthread_cond_wait");
+    real_sem_wait = dlsym(RTLD_NEXT, "sem_wait");
+    real_read = dlsym(RTLD_NEXT, "read");
+    real_write = dlsym(RTLD_NEXT, "write");
+    real_open = dlsym(RTLD_NEXT, "open");
+    real_mmap = dlsym(RTLD_NEXT, "mmap");
+    real_nanosleep = dlsym(RTLD_NEXT, "nanosleep");
+    real_clock_nanosleep = dlsym(RTLD_NEXT, "clock_nanosleep");
+    real_usleep = dlsym(RTLD_NEXT, "usleep");
+    real_random = dlsym(RTLD_NEXT, "random");
+    real_rand = dlsym(RTLD_NEXT, "rand");
+    real_srand = dlsym(RTLD_NEXT, "srand");
+    real_fopen = dlsym(RTLD_NEXT, "fopen");
+    real_fputs = dlsym(RTLD_NEXT, "fputs");
+    real_fputc = dlsym(RTLD_NEXT, "fputc");
+    real_puts = dlsym(RTLD_NEXT, "puts");
+    real_fwrite = dlsym(RTLD_NEXT, "fwrite");
+}
+
+
+#define RT_EXPORT __attribute__((visibility("default")))
+
+RT_EXPORT void*
+malloc(size_t size)
+{
+    rt_call("malloc");
+    return __libc_malloc(size);
+}
+
+RT_EXPORT void*
+calloc(size_t n, size_t size)
+{
+    rt_call("calloc");
+    return __libc_calloc(n, size);
+}
+
+RT_EXPORT void*
+realloc(void* ptr, size_t size)
+{
+    rt_call("realloc");
+    return __libc_realloc(ptr, size);
+}
+
+RT_EXPORT int
+posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+    rt_call("posix_memalign");
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : ENOMEM;
+}
+
+RT_EXPORT void*
+aligned_alloc(size_t alignment, size_t size)
+{
+    rt_call("aligned_alloc");
+    return __libc_memalign(alignment, size);
+}
+
+RT_EXPORT void*
+memalign(size_t alignment, size_t size)
+{
+    rt_call("memalign");
+    return __libc_memalign(alignment, size);
+}
+
+RT_EXPORT void
+free(void* ptr)
+{
+    rt_call("free");
+    __libc_free(ptr);
+}
+
+RT_EXPORT int
+pthread_mutex_lock(pthread_mutex_t* mutex)
+{
+    rt_call("pthread_mutex_lock");
+    return real_pthread_mutex_lock(mutex);
+}
+
+RT_EXPORT int
+pthread_mutex_trylock(pthread_mutex_t* mutex)
+{
+    rt_call("pthread_mutex_trylock");
+    return real_pthread_mutex_trylock(mutex);
+}
+
+RT_EXPORT int
+pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex)
+{
+    rt_call("pthread_cond_wait");
+    return real_pthread_cond_wait(cond, mutex);
+}
+
+RT_EXPORT int
+sem_wait(sem_t* sem)
+{
+    rt_call("sem_wait");
+    return real_sem_wait(sem);
+}
+
+RT_EXPORT ssize_t
+read(int fd, void* buf, size_t count)
+{
+    rt_call("read");
+    return real_read(fd, buf, count);
+}
+
+RT_EXPORT ssize_t
+write(int fd, const void* buf, size_t count)
+{
+    rt_call("write");
+    return real_write(fd, buf, count);
+}
+
+RT_EXPORT int
+open(const char* path, int flags, ...)
+{
+    mode_t mode = 0;
+
+    rt_call("open");
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    return real_open(path, flags, mode);
+}
+
+RT_EXPORT void*
+mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    rt_call("mmap");
+    return real_mmap(addr, length, prot, flags, fd, offset);
+}
+
+RT_EXPORT int
+nanosleep(const struct timespec* req, struct timespec* rem)
+{
+    rt_call("nanosleep");
+    return real_nanosleep(req, rem);
+}
+
+RT_EXPORT int
+clock_nanosleep(clockid_t clock, int flags, const struct timespec* req, struct timespec* rem)
+{
+    rt_call("clock_nanosleep");
+    return real_clock_nanosleep(clock, flags, req, rem);
+}
+
+RT_EXPORT int
+usleep(useconds_t usec)
+{
+    rt_call("usleep");
+    return real_usleep(usec);
+}
+
+// The libc generator keeps its state behind a lock
+RT_EXPORT long
+random(void)
+{
+    rt_call("random");
+    return real_random();
+}
+
+RT_EXPORT int
+rand(void)
+{
+    rt_call("rand");
+    return real_rand();
+}
+
+RT_EXPORT void
+srand(unsigned seed)
+{
+    rt_call("srand");
+    real_srand(seed);
+}
+
+// Stdio locks the stream and only blocks once the buffer is flushed, so the
+// calls are counted themselves. The compiler turns simple printf calls into
+// puts, fputc or fwrite, and fortified builds call the _chk variants.
+RT_EXPORT FILE*
+fopen(const char* path, const char* mode)
+{
+    rt_call("fopen");
+    return real_fopen(path, mode);
+}
+
+RT_EXPORT int
+printf(const char* format, ...)
+{
+    va_list args;
+    rt_call("printf");
+    va_start(args, format);
+    const int ret = vprintf(format, args);
+    va_end(args);
+    return ret;
+}
+
+RT_EXPORT int
+__printf_chk(int flag, const char* format, ...)
+{
+    va_list args;
+    rt_call("printf");
+    va_start(args, format);
+    const int ret = vprintf(format, args);
+    va_end(args);
+    return ret;
+}
+
+RT_EXPORT int
+fprintf(FILE* stream, const char* format, ...)
+{
+    va_list args;
+    rt_call("fprintf");
+    va_start(args, format);
+    const int ret = vfprintf(stream, format, args);
+    va_end(args);
+    return ret;
+}
+
+RT_EXPORT int
+__fprintf_chk(FILE* stream, int flag, const char* format, ...)
+{
+    va_list args;
+    rt_call("fprintf");
+    va_start(args, format);
+    const int ret = vfprintf(stream, format, args);
+    va_end(args);
+    return ret;
+}
+
+RT_EXPORT int
+fputs(const char* str, FILE* stream)
+{
+    rt_call("fputs");
+    return real_fputs(str, stream);
+}
+
+RT_EXPORT int
+fputc(int c, FILE* stream)
+{
+    rt_call("fputc");
+    return real_fputc(c, stream);
+}
+
+RT_EXPORT int
+puts(const char* str)
+{
+    rt_call("puts");
+    return real_puts(str);
+}
+
+RT_EXPORT size_t
+fwrite(const void* ptr, size_t size, size_t n, FILE* stream)
+{
+    rt_call("fwrite");
+    return real_fwrite(ptr, size, n, stream);
+}
+
+
+static LV2_URID
+map_uri(LV2_URID_Map_Handle handle, const char* uri)
+{
+    Host* host = (Host*)handle;
+
+    for (uint32_t i = 0; i < host->n_uris; i++) {
+        if (!strcmp(host->uris[i], uri)) {
+            return i + 1;
+        }
+    }
+    if (host->n_uris == MAX_URIDS) {
+        return 0;
+    }
+    host->uris[host->n_uris] = strdup(uri);
+
+    return ++host->n_uris;
+}
+
+
+// Count the trace lines instead of printing them
+static int
+log_vprintf(LV2_Log_Handle handle, LV2_URID type, const char* fmt, va_list ap)
+{
+    Host* host = (Host*)handle;
+
+    if (type == host->log_Trace) {
+        host->trace_records++;
+    }
+
+    return 0;
+}
+
+
+static int
+log_printf(LV2_Log_Handle handle, LV2_URID type, const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    const int ret = log_vprintf(handle, type, fmt, ap);
+    va_end(ap);
+
+    return ret;
+}
+
+
+// The plugins only schedule drains of their trace, which carry no data
+static LV2_Worker_Status
+schedule_work(LV2_Worker_Schedule_Handle handle, uint32_t size, const void* data)
+{
+    ((Instance*)handle)->work_pending = true;
+
+    return LV2_WORKER_SUCCESS;
+}
+
+
+static LV2_Worker_Status
+respond(LV2_Worker_Respond_Handle handle, uint32_t size, const void* data)
+{
+    ((Instance*)handle)->response_pending = true;
+
+    return LV2_WORKER_SUCCESS;
+}
+
+
+static uint32_t
+rng_next(uint32_t* state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return *state = x;
+}
+
+
+static double
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static void
+append_midi(Host* host, Instance* inst, uint32_t frame, uint8_t status, uint8_t note, uint8_t velocity)
+{
+    const uint8_t msg[3] = { status, note, velocity };
+
+    lv2_atom_forge_frame_time(&inst->forge, frame);
+    lv2_atom_forge_atom(&inst->forge, 3, host->midi_MidiEvent);
+    lv2_atom_forge_write(&inst->forge, msg, 3);
+}
+
+
+static void
+append_position(Host* host, Instance* inst, uint32_t frame, float bpm, float bar_beat)
+{
+    LV2_Atom_Forge_Frame object;
+
+    lv2_atom_forge_frame_time(&inst->forge, frame);
+    lv2_atom_forge_object(&inst->forge, &object, 0, host->time_Position);
+    lv2_atom_forge_key(&inst->forge, host->time_beatsPerMinute);
+    lv2_atom_forge_float(&inst->forge, bpm);
+    lv2_atom_forge_key(&inst->forge, host->time_barBeat);
+    lv2_atom_forge_float(&inst->forge, bar_beat);
+    lv2_atom_forge_key(&inst->forge, host->time_speed);
+    lv2_atom_forge_float(&inst->forge, 1.0f);
+    lv2_atom_forge_pop(&inst->forge, &object);
+}
+
+
+// Fill the input sequence of an instance for one block
+static void
+generate_input(Host* host, Instance* inst, ScenarioType scenario, uint64_t block, uint64_t n_blocks,
+        uint32_t n_samples)
+{
+    static const uint8_t chord[] = { 60, 64, 67, 71 };
+    LV2_Atom_Forge_Frame seq;
+
+    lv2_atom_forge_set_buffer(&inst->forge, inst->in_buf, sizeof(inst->in_buf));
+    lv2_atom_forge_sequence_head(&inst->forge, &seq, 0);
+
+    switch (scenario)
+    {
+        case SCENARIO_IDLE:
+            break;
+        case SCENARIO_TEMPO:
+        case SCENARIO_TRACE:
+        case SCENARIO_STEADY:
+        case SCENARIO_ROUNDED:
+        {
+            const bool steady = (scenario == SCENARIO_STEADY || scenario == SCENARIO_ROUNDED);
+            const float bpm = steady ? 120.0f : 80.0f + (float)(block % 120);
+            const double frames_per_beat = 60.0 * host->samplerate / bpm;
+            const double bar_beat = inst->beat - 4.0 * (uint64_t)(inst->beat / 4.0);
+            const double ticks = (double)(uint64_t)(bar_beat * HOST_TICKS_PER_BEAT);
+            const double next = (uint64_t)(inst->beat * 2.0 + 1.0) / 2.0;
+
+            append_position(host, inst, 0, bpm,
+                    (float)((scenario == SCENARIO_ROUNDED) ? ticks / HOST_TICKS_PER_BEAT : bar_beat));
+            // A short note on every beat at a steady tempo, for the steps of midi-pattern
+            if (steady && next < inst->beat + n_samples / frames_per_beat) {
+                append_midi(host, inst, (uint32_t)((next - inst->beat) * frames_per_beat),
+                        ((uint64_t)(next * 2.0) % 2 == 0) ? LV2_MIDI_MSG_NOTE_ON : LV2_MIDI_MSG_NOTE_OFF,
+                        48, 100);
+            }
+            inst->beat += n_samples * bpm / (60.0 * host->samplerate);
+        }
+            // fall through
+        case SCENARIO_CHORD:
+            if (block == 0) {
+                for (unsigned i = 0; i < sizeof(chord); i++) {
+                    append_midi(host, inst, 0, LV2_MIDI_MSG_NOTE_ON, chord[i], 100);
+                }
+            }
+            break;
+        case SCENARIO_CHANGE:
+            // Release the chord halfway, it keeps playing when latched
+            for (unsigned i = 0; i < sizeof(chord) && (block == 0 || block == n_blocks / 2); i++) {
+                append_midi(host, inst, 0, (block == 0) ? LV2_MIDI_MSG_NOTE_ON : LV2_MIDI_MSG_NOTE_OFF,
+                        chord[i], 100);
+            }
+            break;
+        case SCENARIO_FLOOD:
+        {
+            uint32_t frame = 0;
+            for (unsigned i = 0; i < 16; i++) {
+                const uint8_t note = 36 + rng_next(&inst->rng) % 48;
+                const uint8_t status = inst->held[note] ? LV2_MIDI_MSG_NOTE_OFF : LV2_MIDI_MSG_NOTE_ON;
+                frame += rng_next(&inst->rng) % (n_samples / 16 + 1);
+                frame = (frame < n_samples) ? frame : n_samples - 1;
+                inst->held[note] = !inst->held[note];
+                append_midi(host, inst, frame, status, note, 100);
+            }
+        }
+            break;
+    }
+
+    lv2_atom_forge_pop(&inst->forge, &seq);
+}
+
+
+static uint32_t
+count_events(const Instance* inst)
+{
+    const LV2_Atom_Sequence* out = (const LV2_Atom_Sequence*)inst->out_buf;
+    uint32_t events = 0;
+
+    LV2_ATOM_SEQUENCE_FOREACH(out, ev) {
+        events++;
+    }
+
+    return events;
+}
+
+
+// Fold the output of an instance for one block into a hash
+static uint32_t
+hash_output(const Instance* inst, uint64_t frame, uint32_t hash)
+{
+    const LV2_Atom_Sequence* out = (const LV2_Atom_Sequence*)inst->out_buf;
+
+    LV2_ATOM_SEQUENCE_FOREACH(out, ev) {
+        const uint64_t time = frame + ev->time.frames;
+        const uint8_t* msg = (const uint8_t*)(ev + 1);
+
+        for (uint32_t i = 0; i < sizeof(time); i++) {
+            hash = (hash ^ (uint8_t)(time >> (8 * i))) * 16777619u;
+        }
+        for (uint32_t i = 0; i < ev->body.size; i++) {
+            hash = (hash ^ msg[i]) * 16777619u;
+        }
+    }
+
+    return hash;
+}
+
+
+// Print the output of the first instance for one block
+static void
+trace_block(const PluginInfo* info, const Instance* inst, uint64_t frame, uint32_t block_size)
+{
+    const LV2_Atom_Sequence* out = (const LV2_Atom_Sequence*)inst->out_buf;
+
+    LV2_ATOM_SEQUENCE_FOREACH(out, ev) {
+        const uint8_t* msg = (const uint8_t*)(ev + 1);
+        printf("%llu midi", (unsigned long long)(frame + ev->time.frames));
+        for (uint32_t i = 0; i < ev->body.size; i++) {
+            printf(" %02x", msg[i]);
+        }
+        printf("\n");
+    }
+
+    for (uint32_t p = 0; p < info->n_ports; p++) {
+        if (info->ports[p].type != PORT_CV_OUT) {
+            continue;
+        }
+        float gate = inst->gate;
+        for (uint32_t i = 0; i < block_size; i++) {
+            if (inst->cv[i] != gate) {
+                gate = inst->cv[i];
+                printf("%llu gate %g\n", (unsigned long long)(frame + i), gate);
+            }
+        }
+        ((Instance*)inst)->gate = gate;
+    }
+}
+
+
+static void
+set_sweep(const Sweep* sweep, uint32_t index, float* controls)
+{
+    controls[sweep->port] = sweep->values[index];
+    if (sweep->extra_port >= 0) {
+        controls[sweep->extra_port] = sweep->extra_value;
+    }
+}
+
+
+// In the change scenario every swept control but sync moves on to its next
+// value at a quarter, half and three quarters of the run
+static void
+change_controls(const PluginInfo* info, Instance* inst, uint64_t block, uint64_t n_blocks)
+{
+    const uint64_t quarter = n_blocks / 4;
+
+    if (quarter == 0 || block == 0 || block % quarter != 0) {
+        return;
+    }
+    for (uint32_t s = 0; s < info->n_sweeps; s++) {
+        const Sweep* sweep = &info->sweeps[s];
+        uint32_t v = 0;
+
+        if (sweep->port == info->sync_port) {
+            continue;
+        }
+        while (v < sweep->n_values && sweep->values[v] != inst->controls[sweep->port]) {
+            v++;
+        }
+        set_sweep(sweep, (v + 1) % sweep->n_values, inst->controls);
+    }
+}
+
+
+// Run a scenario with the given control values on a number of instances,
+// printing the output of the first one when tracing
+static Result
+bench(Host* host, const LV2_Descriptor* descriptor, const PluginInfo* info,
+        ScenarioType scenario, const float* controls,
+        uint32_t block_size, uint32_t n_instances, uint32_t out_size, bool trace)
+{
+    Instance* instances = (Instance*)calloc(n_instances, sizeof(Instance));
+    float* cv_buf = (float*)calloc((size_t)block_size * n_instances, sizeof(float));
+
+    for (uint32_t n = 0; n < n_instances; n++) {
+        Instance* inst = &instances[n];
+        const LV2_Feature* features[] = { &host->map_feature, &host->log_feature, &inst->schedule_feature, NULL };
+
+        inst->schedule.handle = inst;
+        inst->schedule.schedule_work = schedule_work;
+        inst->schedule_feature.URI = LV2_WORKER__schedule;
+        inst->schedule_feature.data = &inst->schedule;
+        inst->worker = descriptor->extension_data
+            ? (const LV2_Worker_Interface*)descriptor->extension_data(LV2_WORKER__interface) : NULL;
+        inst->handle = descriptor->instantiate(descriptor, host->samplerate, "", features);
+        inst->cv = &cv_buf[(size_t)n * block_size];
+        inst->rng = 0x9E3779B9u + n;
+        lv2_atom_forge_init(&inst->forge, &host->map);
+        memcpy(inst->controls, controls, sizeof(inst->controls));
+
+        for (uint32_t p = 0; p < info->n_ports; p++) {
+            switch (info->ports[p].type)
+            {
+                case PORT_ATOM_IN:
+                    descriptor->connect_port(inst->handle, p, inst->in_buf);
+                    break;
+                case PORT_ATOM_OUT:
+                    descriptor->connect_port(inst->handle, p, inst->out_buf);
+                    break;
+                case PORT_METRICS_OUT:
+                    descriptor->connect_port(inst->handle, p, inst->metrics_buf);
+                    break;
+                case PORT_CV_IN:
+                case PORT_CV_OUT:
+                    descriptor->connect_port(inst->handle, p, inst->cv);
+                    break;
+                case PORT_CONTROL:
+                    descriptor->connect_port(inst->handle, p, &inst->controls[p]);
+                    break;
+            }
+        }
+        if (descriptor->activate) {
+            descriptor->activate(inst->handle);
+        }
+    }
+
+    const uint64_t n_blocks = (uint64_t)(host->seconds * host->samplerate / block_size) + 1;
+    uint64_t events = 0;
+    uint32_t hash = 2166136261u;
+    double elapsed = 0.0;
+
+    rt_calls = 0;
+    rt_first_call = NULL;
+    host->trace_records = 0;
+
+    for (uint64_t block = 0; block < n_blocks; block++) {
+        for (uint32_t n = 0; n < n_instances; n++) {
+            Instance* inst = &instances[n];
+            LV2_Atom_Sequence* out = (LV2_Atom_Sequence*)inst->out_buf;
+            LV2_Atom_Sequence* metrics = (LV2_Atom_Sequence*)inst->metrics_buf;
+
+            if (scenario == SCENARIO_CHANGE) {
+                change_controls(info, inst, block, n_blocks);
+            }
+            generate_input(host, inst, scenario, block, n_blocks, block_size);
+            out->atom.type = 0;
+            out->atom.size = out_size;
+            metrics->atom.type = 0;
+            metrics->atom.size = sizeof(inst->metrics_buf) - sizeof(LV2_Atom);
+        }
+
+        const double start = now_ns();
+        in_run = true;
+        for (uint32_t n = 0; n < n_instances; n++) {
+            descriptor->run(instances[n].handle, block_size);
+        }
+        in_run = false;
+        elapsed += now_ns() - start;
+
+        if (trace) {
+            trace_block(info, &instances[0], block * block_size, block_size);
+        }
+        hash = hash_output(&instances[0], block * block_size, hash);
+
+        // The work in the worker thread, the response back in the audio thread
+        for (uint32_t n = 0; n < n_instances; n++) {
+            Instance* inst = &instances[n];
+
+            if (inst->work_pending && inst->worker) {
+                inst->work_pending = false;
+                inst->worker->work(inst->handle, respond, inst, 0, NULL);
+            }
+            if (inst->response_pending) {
+                inst->response_pending = false;
+                in_run = true;
+                inst->worker->work_response(inst->handle, 0, NULL);
+                in_run = false;
+            }
+        }
+
+        for (uint32_t n = 0; n < n_instances; n++) {
+            events += count_events(&instances[n]);
+        }
+    }
+
+    for (uint32_t n = 0; n < n_instances; n++) {
+        if (descriptor->deactivate) {
+            descriptor->deactivate(instances[n].handle);
+        }
+        descriptor->cleanup(instances[n].handle);
+    }
+    free(cv_buf);
+    free(instances);
+
+    Result result;
+    result.ns_per_block = elapsed / ((double)n_blocks * n_instances);
+    result.events_per_second = events / (elapsed * 1e-9);
+    result.rt_calls = rt_calls;
+    result.rt_first_call = rt_first_call;
+    result.output_hash = hash;
+    result.trace_records = host->trace_records;
+
+    return result;
+}
+
+
+static void
+init_controls(const PluginInfo* info, ScenarioType scenario, float* controls)
+{
+    memset(controls, 0, MAX_PORTS * sizeof(float));
+
+    for (uint32_t p = 0; p < info->n_ports; p++) {
+        controls[p] = info->ports[p].value;
+    }
+    if (scenario == SCENARIO_TEMPO || scenario == SCENARIO_STEADY || scenario == SCENARIO_ROUNDED
+            || scenario == SCENARIO_TRACE) {
+        controls[info->sync_port] = 1;
+    }
+    if (scenario == SCENARIO_TRACE) {
+        controls[info->trace_port] = 1;
+    }
+}
+
+
+static void
+print_result(const PluginInfo* info, const char* name, uint32_t block_size, uint32_t n_instances,
+        const Result* result)
+{
+    printf("%-14s %-22s %6u %5u %12.1f %10.3f %12.0f\n",
+            info->name, name, block_size, n_instances,
+            result->ns_per_block, result->ns_per_block / block_size, result->events_per_second);
+    if (result->rt_calls > 0) {
+        printf("    warning: %llu calls that are not real-time safe in run(), first %s\n",
+                (unsigned long long)result->rt_calls, result->rt_first_call);
+    }
+}
+
+
+static void
+bench_plugin(Host* host, const LV2_Descriptor* descriptor, const PluginInfo* info,
+        uint32_t block_size, uint32_t n_instances)
+{
+    static const ScenarioType scenarios[] = { SCENARIO_IDLE, SCENARIO_FLOOD, SCENARIO_TEMPO };
+    const uint32_t out_size = ATOM_BUF_SIZE - sizeof(LV2_Atom);
+    float controls[MAX_PORTS];
+    char name[64];
+
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        init_controls(info, scenarios[i], controls);
+        const Result result = bench(host, descriptor, info, scenarios[i], controls,
+                block_size, n_instances, out_size, false);
+        print_result(info, scenario_names[scenarios[i]], block_size, n_instances, &result);
+    }
+    for (uint32_t s = 0; s < info->n_sweeps; s++) {
+        const Sweep* sweep = &info->sweeps[s];
+        for (uint32_t v = 0; v < sweep->n_values; v++) {
+            init_controls(info, SCENARIO_CHORD, controls);
+            set_sweep(sweep, v, controls);
+            snprintf(name, sizeof(name), "%s %s=%g", scenario_names[SCENARIO_CHORD], sweep->name, sweep->values[v]);
+            const Result result = bench(host, descriptor, info, SCENARIO_CHORD, controls,
+                    block_size, n_instances, out_size, false);
+            print_result(info, name, block_size, n_instances, &result);
+        }
+    }
+}
+
+
+// Run every scenario for every combination of the swept controls, with a
+// normal and a tiny output buffer. Reports the runs that made calls that are
+// not real-time safe, or prints the output of every run when tracing.
+// Returns the number of failed runs.
+static uint32_t
+check_plugin(Host* host, const LV2_Descriptor* descriptor, const PluginInfo* info,
+        uint32_t block_size, bool trace)
+{
+    static const ScenarioType scenarios[] = {
+        SCENARIO_IDLE, SCENARIO_CHORD, SCENARIO_FLOOD, SCENARIO_TEMPO, SCENARIO_CHANGE, SCENARIO_ROUNDED,
+        SCENARIO_TRACE
+    };
+    const uint32_t out_sizes[] = { ATOM_BUF_SIZE - sizeof(LV2_Atom), SMALL_OUT_SIZE };
+    uint32_t runs = 0;
+    uint32_t failed = 0;
+
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        for (size_t o = 0; o < sizeof(out_sizes) / sizeof(out_sizes[0]); o++) {
+            uint32_t index[4] = { 0, 0, 0, 0 };
+            bool done = false;
+
+            while (!done) {
+                float controls[MAX_PORTS];
+                char name[128];
+                int len;
+
+                init_controls(info, scenarios[i], controls);
+                len = snprintf(name, sizeof(name), "%s out=%u", scenario_names[scenarios[i]], out_sizes[o]);
+                for (uint32_t s = 0; s < info->n_sweeps; s++) {
+                    set_sweep(&info->sweeps[s], index[s], controls);
+                    len += snprintf(name + len, sizeof(name) - len, " %s=%g",
+                            info->sweeps[s].name, info->sweeps[s].values[index[s]]);
+                }
+
+                if (trace) {
+                    printf("# %s %s block=%u\n", info->name, name, block_size);
+                }
+                const Result result = bench(host, descriptor, info, scenarios[i], controls,
+                        block_size, 1, out_sizes[o], trace);
+                runs++;
+                if (result.rt_calls > 0) {
+                    printf("FAIL %s %s block=%u: %llu calls, first %s\n", info->name, name, block_size,
+                            (unsigned long long)result.rt_calls, result.rt_first_call);
+                    failed++;
+                } else if (scenarios[i] == SCENARIO_ROUNDED) {
+                    // Rounding of the host must not move the steps
+                    const Result exact = bench(host, descriptor, info, SCENARIO_STEADY, controls,
+                            block_size, 1, out_sizes[o], false);
+                    if (exact.output_hash != result.output_hash) {
+                        printf("FAIL %s %s block=%u: output differs from the one with exact positions\n",
+                                info->name, name, block_size);
+                        failed++;
+                    }
+                } else if (scenarios[i] == SCENARIO_TRACE && result.trace_records == 0) {
+                    printf("FAIL %s %s block=%u: no trace records reached the worker\n",
+                            info->name, name, block_size);
+                    failed++;
+                }
+
+                // Next combination of the swept values
+                done = true;
+                for (uint32_t s = 0; s < info->n_sweeps; s++) {
+                    if (++index[s] < info->sweeps[s].n_values) {
+                        done = false;
+                        break;
+                    }
+                    index[s] = 0;
+                }
+            }
+        }
+    }
+
+    if (!trace) {
+        printf("%-14s block %5u: %u runs, %u failed\n", info->name, block_size, runs, failed);
+    }
+
+    return failed;
+}
+
+
+static uint32_t
+parse_list(const char* arg, uint32_t* values)
+{
+    uint32_t n = 0;
+    char* end;
+
+    while (*arg && n < MAX_SIZES) {
+        values[n] = (uint32_t)strtoul(arg, &end, 10);
+        if (end == arg || values[n] == 0) {
+            return 0;
+        }
+        n++;
+        arg = (*end == ',') ? end + 1 : end;
+    }
+
+    return n;
+}
+
+
+static void
+usage(const char* name)
+{
+    fprintf(stderr,
+            "Usage: %s [-c|-t] [-b BLOCKSIZES] [-i INSTANCES] [-r RATE] [-s SECONDS] PLUGIN.so...\n"
+            "  -c  check that run() is real-time safe instead of measuring it\n"
+            "  -t  print the output of every run instead of measuring it\n"
+            "  -b  comma separated block sizes (default 64,256,1024)\n"
+            "  -i  comma separated instance counts (default 1,16)\n"
+            "  -r  sample rate (default 48000)\n"
+            "  -s  seconds of audio per measurement (default 10)\n", name);
+}
+
+
+int
+main(int argc, char** argv)
+{
+    uint32_t block_sizes[MAX_SIZES] = { 64, 256, 1024 };
+    uint32_t n_block_sizes = 3;
+    uint32_t instance_counts[MAX_SIZES] = { 1, 16 };
+    uint32_t n_instance_counts = 2;
+    uint32_t failed = 0;
+    bool check = false;
+    bool trace = false;
+    Host host;
+    int opt;
+
+    rt_init();
+    memset(&host, 0, sizeof(host));
+    host.samplerate = 48000.0;
+    host.seconds = 10.0;
+
+    while ((opt = getopt(argc, argv, "ctb:i:r:s:h")) != -1) {
+        switch (opt)
+        {
+            case 'c':
+                check = true;
+                host.seconds = 0.5;
+                break;
+            case 't':
+                check = true;
+                trace = true;
+                host.seconds = 0.5;
+                break;
+            case 'b':
+                n_block_sizes = parse_list(optarg, block_sizes);
+                break;
+            case 'i':
+                n_instance_counts = parse_list(optarg, instance_counts);
+                break;
+            case 'r':
+                host.samplerate = atof(optarg);
+                break;
+            case 's':
+                host.seconds = atof(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc || !n_block_sizes || !n_instance_counts
+            || host.samplerate <= 0 || host.seconds <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    for (uint32_t i = 0; i < n_instance_counts; i++) {
+        if (instance_counts[i] > MAX_INSTANCES) {
+            fprintf(stderr, "At most %d instances are supported\n", MAX_INSTANCES);
+            return 1;
+        }
+    }
+
+    host.map.handle = &host;
+    host.map.map = map_uri;
+    host.map_feature.URI = LV2_URID__map;
+    host.map_feature.data = &host.map;
+    host.log.handle = &host;
+    host.log.printf = log_printf;
+    host.log.vprintf = log_vprintf;
+    host.log_feature.URI = LV2_LOG__log;
+    host.log_feature.data = &host.log;
+    host.midi_MidiEvent = map_uri(&host, LV2_MIDI__MidiEvent);
+    host.time_Position = map_uri(&host, LV2_TIME__Position);
+    host.time_barBeat = map_uri(&host, LV2_TIME__barBeat);
+    host.time_beatsPerMinute = map_uri(&host, LV2_TIME__beatsPerMinute);
+    host.time_speed = map_uri(&host, LV2_TIME__speed);
+    host.log_Trace = map_uri(&host, LV2_LOG__Trace);
+
+    if (!check) {
+        printf("%-14s %-22s %6s %5s %12s %10s %12s\n",
+                "plugin", "scenario", "block", "inst", "ns/block", "ns/sample", "events/s");
+    }
+
+    for (int a = optind; a < argc; a++) {
+        void* lib = dlopen(argv[a], RTLD_NOW | RTLD_LOCAL);
+        if (!lib) {
+            fprintf(stderr, "%s\n", dlerror());
+            return 1;
+        }
+
+        LV2_Descriptor_Function get_descriptor = (LV2_Descriptor_Function)dlsym(lib, "lv2_descriptor");
+        if (!get_descriptor) {
+            fprintf(stderr, "%s: no lv2_descriptor symbol\n", argv[a]);
+            return 1;
+        }
+
+        const LV2_Descriptor* descriptor;
+        for (uint32_t d = 0; (descriptor = get_descriptor(d)); d++) {
+            const PluginInfo* info = NULL;
+            for (size_t p = 0; p < sizeof(plugins) / sizeof(plugins[0]); p++) {
+                if (!strcmp(plugins[p].uri, descriptor->URI)) {
+                    info = &plugins[p];
+                }
+            }
+            if (!info) {
+                fprintf(stderr, "%s: unknown plugin, skipping\n", descriptor->URI);
+                continue;
+            }
+
+            for (uint32_t b = 0; b < n_block_sizes; b++) {
+                if (check) {
+                    failed += check_plugin(&host, descriptor, info, block_sizes[b], trace);
+                    continue;
+                }
+                for (uint32_t i = 0; i < n_instance_counts; i++) {
+                    bench_plugin(&host, descriptor, info, block_sizes[b], instance_counts[i]);
+                }
+            }
+        }
+        dlclose(lib);
+    }
+
+    for (uint32_t i = 0; i < host.n_uris; i++) {
+        free(host.uris[i]);
+    }
+
+    return (failed > 0) ? 1 : 0;
+}
@@ -0,0 +1,1040 @@
+// Offline renderer for the arpeggiator and midi-pattern plugins.
+//
+// Reads Standard MIDI Files, plays them through the plugin binaries at
+// faster than real-time speed and writes the output as new MIDI files. The
+// plugins are loaded and run exactly like in a live host: the input is cut
+// into blocks, every block starts with a time:Position following the tempo
+// map of the file and the MIDI output of one plugin is the input of the
+// next. Several files are rendered in parallel.
+
+#include <dlfcn.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include <lv2/lv2plug.in/ns/lv2core/lv2.h>
+#include <lv2/lv2plug.in/ns/ext/atom/atom.h>
+#include <lv2/lv2plug.in/ns/ext/atom/forge.h>
+#include <lv2/lv2plug.in/ns/ext/midi/midi.h>
+#include "lv2/lv2plug.in/ns/ext/time/time.h"
+#include <lv2/lv2plug.in/ns/ext/urid/urid.h>
+
+#define MAX_PORTS     32
+#define MAX_URIDS     256
+#define MAX_STAGES    2
+#define MAX_SETTINGS  32
+#define ATOM_BUF_SIZE 65536
+
+
+typedef enum {
+    PORT_ATOM_IN,
+    PORT_ATOM_OUT,
+    PORT_CV_IN,
+    PORT_CV_OUT,
+    PORT_CONTROL,
+    PORT_OPTIONAL
+} PortType;
+
+
+typedef struct {
+    PortType    type;
+    const char* symbol;
+    float       value;
+} PortInfo;
+
+
+typedef struct {
+    const char* uri;
+    const char* name;
+    uint32_t    n_ports;
+    PortInfo    ports[MAX_PORTS];
+} PluginInfo;
+
+
+// The seed of the arpeggiator defaults to 1 instead of 0, so that renders
+// of the random modes can be repeated
+static const PluginInfo plugins[] = {
+    {
+        "http://bramgiesen.com/arpeggiator", "arpeggiator", 16,
+        {
+            { PORT_ATOM_IN, "MIDI_in", 0 }, { PORT_ATOM_OUT, "MIDI_out", 0 },
+            { PORT_CV_OUT, "gate", 0 },
+            { PORT_CONTROL, "Bpm", 120 },
+            { PORT_CONTROL, "arpMode", 0 },
+            { PORT_CONTROL, "latchMode", 0 },
+            { PORT_CONTROL, "Divisions", 8 },
+            { PORT_CONTROL, "sync", 0 },
+            { PORT_CONTROL, "noteLength", 0.75 },
+            { PORT_CONTROL, "octaveSpread", 1 },
+            { PORT_CONTROL, "octaveMode", 0 },
+            { PORT_CONTROL, "velocity", 60 },
+            { PORT_CONTROL, "BYPASS", 1 },
+            { PORT_CONTROL, "seed", 1 },
+            { PORT_OPTIONAL, "metrics", 0 },
+            { PORT_CONTROL, "trace", 0 },
+        }
+    },
+    {
+        "http://bramgiesen.com/midi-pattern", "midi-pattern", 16,
+        {
+            { PORT_ATOM_IN, "MIDI_in", 0 }, { PORT_ATOM_OUT, "MIDI_out", 0 },
+            { PORT_CV_IN, "retrigger", 0 },
+            { PORT_CONTROL, "sync", 0 },
+            { PORT_CONTROL, "Divisions", 8 },
+            { PORT_CONTROL, "patternlength", 4 },
+            { PORT_CONTROL, "velocityNote1", 60 }, { PORT_CONTROL, "velocityNote2", 60 },
+            { PORT_CONTROL, "velocityNote3", 60 }, { PORT_CONTROL, "velocityNote4", 60 },
+            { PORT_CONTROL, "velocityNote5", 60 }, { PORT_CONTROL, "velocityNote6", 60 },
+            { PORT_CONTROL, "velocityNote7", 60 }, { PORT_CONTROL, "velocityNote8", 60 },
+            { PORT_OPTIONAL, "metrics", 0 },
+            { PORT_CONTROL, "trace", 0 },
+        }
+    },
+};
+
+
+// A plugin in the chain with the control values to render with
+typedef struct {
+    const LV2_Descriptor* descriptor;
+    const PluginInfo*     info;
+    float                 controls[MAX_PORTS];
+} StageConfig;
+
+
+typedef struct {
+    StageConfig   stages[MAX_STAGES];
+    uint32_t      n_stages;
+    double        samplerate;
+    uint32_t      block_size;
+    double        tail; // Seconds rendered after the last input event
+    const char*   out_dir;
+    char**        files;
+    uint32_t      n_files;
+    uint32_t      next_file;
+    uint32_t      failed;
+} Renderer;
+
+
+// MIDI channel message or meta event at a tick of the file
+typedef struct {
+    uint64_t  tick;
+    uint32_t  order; // Position in the file, keeps sorting stable
+    uint8_t   meta;  // Meta event type, 0 for channel messages
+    uint8_t   size;
+    uint8_t   data[4];
+} SmfEvent;
+
+
+typedef struct {
+    uint64_t  tick;
+    uint32_t  us_per_quarter;
+    double    seconds; // Time at the start of this tempo
+} Tempo;
+
+
+typedef struct {
+    uint64_t  tick;
+    double    bar_length; // In quarter notes
+} Meter;
+
+
+typedef struct {
+    uint16_t  division;
+    SmfEvent* events;
+    size_t    n_events;
+    size_t    events_size;
+    Tempo*    tempos;
+    size_t    n_tempos;
+    Meter*    meters;
+    size_t    n_meters;
+} Smf;
+
+
+// URID map of a render thread
+typedef struct {
+    char*         uris[MAX_URIDS];
+    uint32_t      n_uris;
+    LV2_URID_Map  map;
+    LV2_Feature   map_feature;
+} UridMap;
+
+
+typedef struct {
+    LV2_Handle  handle;
+    float       controls[MAX_PORTS];
+    float*      cv;
+    uint8_t     in_buf[ATOM_BUF_SIZE] __attribute__((aligned(8)));
+    uint8_t     out_buf[ATOM_BUF_SIZE] __attribute__((aligned(8)));
+} Stage;
+
+
+static LV2_URID
+map_uri(LV2_URID_Map_Handle handle, const char* uri)
+{
+    UridMap* urids = (UridMap*)handle;
+
+    for (uint32_t i = 0; i < urids->n_uris; i++) {
+        if (!strcmp(urids->uris[i], uri)) {
+            return i + 1;
+        }
+    }
+    if (urids->n_uris == MAX_URIDS) {
+        return 0;
+    }
+    urids->uris[urids->n_uris] = strdup(uri);
+
+    return ++urids->n_uris;
+}
+
+
+static bool
+smf_append(Smf* smf, const SmfEvent* event)
+{
+    if (smf->n_events == smf->events_size) {
+        const size_t size = smf->events_size ? smf->events_size * 2 : 1024;
+        SmfEvent* events = (SmfEvent*)realloc(smf->events, size * sizeof(SmfEvent));
+        if (!events) {
+            return false;
+        }
+        smf->events = events;
+        smf->events_size = size;
+    }
+    smf->events[smf->n_events] = *event;
+    smf->events[smf->n_events].order = (uint32_t)smf->n_events;
+    smf->n_events++;
+
+    return true;
+}
+
+
+static int
+compare_events(const void* a, const void* b)
+{
+    const SmfEvent* ea = (const SmfEvent*)a;
+    const SmfEvent* eb = (const SmfEvent*)b;
+
+    if (ea->tick != eb->tick) {
+        return (ea->tick < eb->tick) ? -1 : 1;
+    }
+    // Tempo and meter changes go before the notes at the same tick
+    if ((ea->meta != 0) != (eb->meta != 0)) {
+        return ea->meta ? -1 : 1;
+    }
+
+    return (ea->order < eb->order) ? -1 : (ea->order > eb->order);
+}
+
+
+static uint32_t
+read_u32(const uint8_t* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+
+static bool
+read_varlen(const uint8_t** p, const uint8_t* end, uint32_t* value)
+{
+    *value = 0;
+    for (int i = 0; i < 4 && *p < end; i++) {
+        const uint8_t byte = *(*p)++;
+        *value = (*value << 7) | (byte & 0x7F);
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+static const char*
+parse_track(Smf* smf, const uint8_t* p, const uint8_t* end)
+{
+    uint64_t tick = 0;
+    uint8_t status = 0;
+
+    while (p < end) {
+        uint32_t delta;
+        SmfEvent event;
+
+        if (!read_varlen(&p, end, &delta) || p >= end) {
+            return "truncated track";
+        }
+        tick += delta;
+        memset(&event, 0, sizeof(event));
+        event.tick = tick;
+
+        if (*p == 0xFF) {
+            uint32_t length;
+            if (p + 2 > end) {
+                return "truncated meta event";
+            }
+            const uint8_t type = p[1];
+            p += 2;
+            if (!read_varlen(&p, end, &length) || p + length > end) {
+                return "truncated meta event";
+            }
+            if ((type == 0x51 && length == 3) || (type == 0x58 && length == 4)) {
+                event.meta = type;
+                event.size = (uint8_t)length;
+                memcpy(event.data, p, length);
+                if (!smf_append(smf, &event)) {
+                    return "out of memory";
+                }
+            }
+            p += length;
+            if (type == 0x2F) {
+                break;
+            }
+        } else if (*p == 0xF0 || *p == 0xF7) {
+            uint32_t length;
+            p++;
+            if (!read_varlen(&p, end, &length) || p + length > end) {
+                return "truncated sysex";
+            }
+            p += length;
+        } else {
+            if (*p & 0x80) {
+                status = *p++;
+            } else if (!status) {
+                return "data byte without status";
+            }
+            const uint8_t type = status & 0xF0;
+            const uint8_t size = (type == 0xC0 || type == 0xD0) ? 2 : 3;
+            if (p + size - 1 > end) {
+                return "truncated event";
+            }
+            event.size = size;
+            event.data[0] = status;
+            memcpy(&event.data[1], p, size - 1);
+            p += size - 1;
+            // Keep a note on with velocity 0 as a note off
+            if (type == LV2_MIDI_MSG_NOTE_ON && event.data[2] == 0) {
+                event.data[0] = LV2_MIDI_MSG_NOTE_OFF | (status & 0x0F);
+            }
+            if (!smf_append(smf, &event)) {
+                return "out of memory";
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+// Build the tempo and meter maps from the meta events of the file
+static const char*
+build_maps(Smf* smf)
+{
+    size_t n_tempos = 1;
+    size_t n_meters = 1;
+
+    for (size_t i = 0; i < smf->n_events; i++) {
+        n_tempos += smf->events[i].meta == 0x51;
+        n_meters += smf->events[i].meta == 0x58;
+    }
+    smf->tempos = (Tempo*)calloc(n_tempos, sizeof(Tempo));
+    smf->meters = (Meter*)calloc(n_meters, sizeof(Meter));
+    if (!smf->tempos || !smf->meters) {
+        return "out of memory";
+    }
+
+    // 120 BPM in 4/4 until the file says otherwise
+    smf->tempos[0].us_per_quarter = 500000;
+    smf->meters[0].bar_length = 4.0;
+    smf->n_tempos = 1;
+    smf->n_meters = 1;
+
+    for (size_t i = 0; i < smf->n_events; i++) {
+        const SmfEvent* event = &smf->events[i];
+
+        if (event->meta == 0x51) {
+            Tempo* last = &smf->tempos[smf->n_tempos - 1];
+            Tempo* tempo = (last->tick == event->tick) ? last : &smf->tempos[smf->n_tempos++];
+            tempo->seconds = last->seconds
+                + (double)(event->tick - last->tick) * last->us_per_quarter / (1e6 * smf->division);
+            tempo->tick = event->tick;
+            tempo->us_per_quarter = ((uint32_t)event->data[0] << 16) | ((uint32_t)event->data[1] << 8)
+                | event->data[2];
+            tempo->us_per_quarter = tempo->us_per_quarter ? tempo->us_per_quarter : 1;
+        } else if (event->meta == 0x58) {
+            Meter* last = &smf->meters[smf->n_meters - 1];
+            Meter* meter = (last->tick == event->tick) ? last : &smf->meters[smf->n_meters++];
+            meter->tick = event->tick;
+            meter->bar_length = event->data[0] * 4.0 / (double)(1 << (event->data[1] & 7));
+        }
+    }
+
+    return NULL;
+}
+
+
+static const char*
+read_smf(Smf* smf, const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    const char* error = NULL;
+
+    memset(smf, 0, sizeof(Smf));
+    if (!file) {
+        return "cannot open file";
+    }
+
+    fseek(file, 0, SEEK_END);
+    const long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t* data = (size > 0) ? (uint8_t*)malloc((size_t)size) : NULL;
+    if (!data || fread(data, 1, (size_t)size, file) != (size_t)size) {
+        fclose(file);
+        free(data);
+        return "cannot read file";
+    }
+    fclose(file);
+
+    const uint8_t* p = data;
+    const uint8_t* end = data + size;
+
+    if (size < 14 || memcmp(p, "MThd", 4) || read_u32(p + 4) < 6) {
+        error = "not a standard MIDI file";
+    } else if (p[12] & 0x80) {
+        error = "SMPTE time division is not supported";
+    } else {
+        const uint16_t n_tracks = (uint16_t)((p[10] << 8) | p[11]);
+        smf->division = (uint16_t)((p[12] << 8) | p[13]);
+        p += 8 + read_u32(p + 4);
+
+        for (uint16_t t = 0; t < n_tracks && !error; t++) {
+            if (p + 8 > end || memcmp(p, "MTrk", 4)) {
+                error = "missing track";
+                break;
+            }
+            const uint32_t length = read_u32(p + 4);
+            if (length > (size_t)(end - p - 8)) {
+                error = "truncated track";
+                break;
+            }
+            error = parse_track(smf, p + 8, p + 8 + length);
+            p += 8 + length;
+        }
+    }
+    free(data);
+
+    if (!error && smf->division == 0) {
+        error = "invalid time division";
+    }
+    if (!error) {
+        qsort(smf->events, smf->n_events, sizeof(SmfEvent), compare_events);
+        error = build_maps(smf);
+    }
+
+    return error;
+}
+
+
+static void
+free_smf(Smf* smf)
+{
+    free(smf->events);
+    free(smf->tempos);
+    free(smf->meters);
+}
+
+
+static const Tempo*
+tempo_at_tick(const Smf* smf, double tick)
+{
+    size_t i = smf->n_tempos - 1;
+
+    while (i > 0 && smf->tempos[i].tick > tick) {
+        i--;
+    }
+
+    return &smf->tempos[i];
+}
+
+
+static const Tempo*
+tempo_at_seconds(const Smf* smf, double seconds)
+{
+    size_t i = smf->n_tempos - 1;
+
+    while (i > 0 && smf->tempos[i].seconds > seconds) {
+        i--;
+    }
+
+    return &smf->tempos[i];
+}
+
+
+static double
+tick_to_seconds(const Smf* smf, double tick)
+{
+    const Tempo* tempo = tempo_at_tick(smf, tick);
+
+    return tempo->seconds + (tick - tempo->tick) * tempo->us_per_quarter / (1e6 * smf->division);
+}
+
+
+static double
+seconds_to_tick(const Smf* smf, double seconds)
+{
+    const Tempo* tempo = tempo_at_seconds(smf, seconds);
+
+    return tempo->tick + (seconds - tempo->seconds) * 1e6 * smf->division / tempo->us_per_quarter;
+}
+
+
+// Beat position inside the bar, in quarter notes
+static double
+bar_beat_at_tick(const Smf* smf, double tick)
+{
+    size_t i = smf->n_meters - 1;
+
+    while (i > 0 && smf->meters[i].tick > tick) {
+        i--;
+    }
+
+    const double quarters = (tick - smf->meters[i].tick) / smf->division;
+
+    return fmod(quarters, smf->meters[i].bar_length);
+}
+
+
+static void
+put_u32(uint8_t* p, uint32_t value)
+{
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+
+static void
+write_varlen(FILE* file, uint32_t value)
+{
+    uint8_t bytes[5];
+    int n = 0;
+
+    bytes[n++] = value & 0x7F;
+    while ((value >>= 7)) {
+        bytes[n++] = 0x80 | (value & 0x7F);
+    }
+    while (n > 0) {
+        fputc(bytes[--n], file);
+    }
+}
+
+
+// Write the events as a format 0 file
+static const char*
+write_smf(const Smf* smf, const char* path)
+{
+    FILE* file = fopen(path, "wb");
+    uint8_t header[22] = { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0, 0,
+                           'M', 'T', 'r', 'k', 0, 0, 0, 0 };
+    uint64_t tick = 0;
+
+    if (!file) {
+        return "cannot create output file";
+    }
+
+    header[12] = (uint8_t)(smf->division >> 8);
+    header[13] = (uint8_t)smf->division;
+    fwrite(header, 1, sizeof(header), file);
+
+    for (size_t i = 0; i < smf->n_events; i++) {
+        const SmfEvent* event = &smf->events[i];
+
+        write_varlen(file, (uint32_t)(event->tick - tick));
+        tick = event->tick;
+        if (event->meta) {
+            fputc(0xFF, file);
+            fputc(event->meta, file);
+            write_varlen(file, event->size);
+        }
+        fwrite(event->data, 1, event->size, file);
+    }
+    fwrite("\x00\xFF\x2F\x00", 1, 4, file);
+
+    const long track_size = ftell(file) - (long)sizeof(header);
+    put_u32(header + 18, (uint32_t)track_size);
+    fseek(file, 0, SEEK_SET);
+    fwrite(header, 1, sizeof(header), file);
+
+    if (fclose(file) != 0) {
+        return "cannot write output file";
+    }
+
+    return NULL;
+}
+
+
+static void
+append_position(UridMap* urids, LV2_Atom_Forge* forge, const Smf* smf, double tick)
+{
+    LV2_Atom_Forge_Frame object;
+    const float bpm = 60e6f / tempo_at_tick(smf, tick)->us_per_quarter;
+
+    lv2_atom_forge_frame_time(forge, 0);
+    lv2_atom_forge_object(forge, &object, 0, map_uri(urids, LV2_TIME__Position));
+    lv2_atom_forge_key(forge, map_uri(urids, LV2_TIME__beatsPerMinute));
+    lv2_atom_forge_float(forge, bpm);
+    lv2_atom_forge_key(forge, map_uri(urids, LV2_TIME__barBeat));
+    lv2_atom_forge_float(forge, (float)bar_beat_at_tick(smf, tick));
+    lv2_atom_forge_key(forge, map_uri(urids, LV2_TIME__speed));
+    lv2_atom_forge_float(forge, 1.0f);
+    lv2_atom_forge_pop(forge, &object);
+}
+
+
+// Collect a MIDI event of the last stage, tracking the sounding notes so
+// they can be ended at the end of the render
+static bool
+collect_event(Smf* out, const Smf* in, uint8_t* sounding, double seconds, const uint8_t* msg, uint32_t size)
+{
+    SmfEvent event;
+
+    if (size < 1 || size > 3) {
+        return true;
+    }
+    memset(&event, 0, sizeof(event));
+    event.tick = (uint64_t)llround(seconds_to_tick(in, seconds));
+    event.size = (uint8_t)size;
+    memcpy(event.data, msg, size);
+
+    const uint8_t type = msg[0] & 0xF0;
+    if (size == 3 && type == LV2_MIDI_MSG_NOTE_ON && msg[2] > 0) {
+        sounding[((msg[0] & 0x0F) << 7) | (msg[1] & 0x7F)]++;
+    } else if (size == 3 && (type == LV2_MIDI_MSG_NOTE_OFF || type == LV2_MIDI_MSG_NOTE_ON)) {
+        uint8_t* count = &sounding[((msg[0] & 0x0F) << 7) | (msg[1] & 0x7F)];
+        *count = (*count > 0) ? *count - 1 : 0;
+    }
+
+    return smf_append(out, &event);
+}
+
+
+static const char*
+render(const Renderer* r, UridMap* urids, const Smf* in, Smf* out)
+{
+    Stage* stages = (Stage*)calloc(r->n_stages, sizeof(Stage));
+    float* cv_buf = (float*)calloc((size_t)r->block_size * r->n_stages, sizeof(float));
+    uint8_t* sounding = (uint8_t*)calloc(16 * 128, 1);
+    const LV2_URID midi_event = map_uri(urids, LV2_MIDI__MidiEvent);
+    const char* error = NULL;
+    LV2_Atom_Forge forge;
+
+    if (!stages || !cv_buf || !sounding) {
+        free(stages);
+        free(cv_buf);
+        free(sounding);
+        return "out of memory";
+    }
+    lv2_atom_forge_init(&forge, &urids->map);
+
+    memset(out, 0, sizeof(Smf));
+    out->division = in->division;
+
+    for (uint32_t s = 0; s < r->n_stages; s++) {
+        const StageConfig* config = &r->stages[s];
+        const LV2_Descriptor* descriptor = config->descriptor;
+        const LV2_Feature* features[] = { &urids->map_feature, NULL };
+        Stage* stage = &stages[s];
+
+        stage->handle = descriptor->instantiate(descriptor, r->samplerate, "", features);
+        if (!stage->handle) {
+            error = "cannot instantiate plugin";
+            break;
+        }
+        stage->cv = &cv_buf[(size_t)s * r->block_size];
+        memcpy(stage->controls, config->controls, sizeof(stage->controls));
+
+        for (uint32_t p = 0; p < config->info->n_ports; p++) {
+            switch (config->info->ports[p].type)
+            {
+                case PORT_ATOM_IN:
+                    descriptor->connect_port(stage->handle, p, stage->in_buf);
+                    break;
+                case PORT_ATOM_OUT:
+                    descriptor->connect_port(stage->handle, p, stage->out_buf);
+                    break;
+                case PORT_CV_IN:
+                case PORT_CV_OUT:
+                    descriptor->connect_port(stage->handle, p, stage->cv);
+                    break;
+                case PORT_CONTROL:
+                    descriptor->connect_port(stage->handle, p, &stage->controls[p]);
+                    break;
+                case PORT_OPTIONAL:
+                    descriptor->connect_port(stage->handle, p, NULL);
+                    break;
+            }
+        }
+        if (descriptor->activate) {
+            descriptor->activate(stage->handle);
+        }
+    }
+
+    // The tempo and meter changes are copied to the output as they are
+    for (size_t i = 0; i < in->n_events && !error; i++) {
+        if (in->events[i].meta && !smf_append(out, &in->events[i])) {
+            error = "out of memory";
+        }
+    }
+
+    const double last = in->n_events ? tick_to_seconds(in, (double)in->events[in->n_events - 1].tick) : 0.0;
+    const uint64_t end_frame = (uint64_t)((last + r->tail) * r->samplerate);
+    size_t next = 0;
+
+    for (uint64_t frame = 0; frame < end_frame && !error; frame += r->block_size) {
+        const double block_tick = seconds_to_tick(in, frame / r->samplerate);
+
+        for (uint32_t s = 0; s < r->n_stages; s++) {
+            Stage* stage = &stages[s];
+            LV2_Atom_Forge_Frame seq;
+
+            lv2_atom_forge_set_buffer(&forge, stage->in_buf, sizeof(stage->in_buf));
+            lv2_atom_forge_sequence_head(&forge, &seq, 0);
+            append_position(urids, &forge, in, block_tick);
+
+            if (s == 0) {
+                // The events of the file that fall inside this block
+                while (next < in->n_events) {
+                    const SmfEvent* event = &in->events[next];
+                    const uint64_t event_frame = (uint64_t)llround(tick_to_seconds(in, (double)event->tick) * r->samplerate);
+                    if (event_frame >= frame + r->block_size) {
+                        break;
+                    }
+                    if (!event->meta) {
+                        const uint64_t offset = (event_frame > frame) ? event_frame - frame : 0;
+                        lv2_atom_forge_frame_time(&forge, (int64_t)offset);
+                        lv2_atom_forge_atom(&forge, event->size, midi_event);
+                        lv2_atom_forge_write(&forge, event->data, event->size);
+                    }
+                    next++;
+                }
+            } else {
+                // The MIDI output of the previous plugin
+                const LV2_Atom_Sequence* prev = (const LV2_Atom_Sequence*)stages[s - 1].out_buf;
+                LV2_ATOM_SEQUENCE_FOREACH(prev, ev) {
+                    if (ev->body.type == midi_event) {
+                        lv2_atom_forge_frame_time(&forge, ev->time.frames);
+                        lv2_atom_forge_atom(&forge, ev->body.size, midi_event);
+                        lv2_atom_forge_write(&forge, ev + 1, ev->body.size);
+                    }
+                }
+            }
+            lv2_atom_forge_pop(&forge, &seq);
+
+            LV2_Atom_Sequence* out_seq = (LV2_Atom_Sequence*)stage->out_buf;
+            out_seq->atom.type = 0;
+            out_seq->atom.size = sizeof(stage->out_buf) - sizeof(LV2_Atom);
+            r->stages[s].descriptor->run(stage->handle, r->block_size);
+        }
+
+        const LV2_Atom_Sequence* result = (const LV2_Atom_Sequence*)stages[r->n_stages - 1].out_buf;
+        LV2_ATOM_SEQUENCE_FOREACH(result, ev) {
+            const double seconds = (frame + ev->time.frames) / r->samplerate;
+            if (ev->body.type == midi_event
+                    && !collect_event(out, in, sounding, seconds, (const uint8_t*)(ev + 1), ev->body.size)) {
+                error = "out of memory";
+                break;
+            }
+        }
+    }
+
+    // End the notes that still sound, e.g. in latch mode
+    const double end_seconds = end_frame / r->samplerate;
+    for (unsigned i = 0; i < 16 * 128 && !error; i++) {
+        while (sounding[i] > 0) {
+            const uint8_t msg[3] = { (uint8_t)(LV2_MIDI_MSG_NOTE_OFF | (i >> 7)), (uint8_t)(i & 0x7F), 0 };
+            if (!collect_event(out, in, sounding, end_seconds, msg, 3)) {
+                error = "out of memory";
+                break;
+            }
+        }
+    }
+
+    for (uint32_t s = 0; s < r->n_stages; s++) {
+        const LV2_Descriptor* descriptor = r->stages[s].descriptor;
+        if (!stages[s].handle) {
+            continue;
+        }
+        if (descriptor->deactivate) {
+            descriptor->deactivate(stages[s].handle);
+        }
+        descriptor->cleanup(stages[s].handle);
+    }
+    free(sounding);
+    free(cv_buf);
+    free(stages);
+
+    if (!error) {
+        qsort(out->events, out->n_events, sizeof(SmfEvent), compare_events);
+    }
+
+    return error;
+}
+
+
+static void
+output_path(const Renderer* r, const char* in_path, char* path, size_t size)
+{
+    const char* base = strrchr(in_path, '/');
+    const char* name = (r->out_dir && base) ? base + 1 : in_path;
+    size_t length = strlen(name);
+
+    if (length > 4 && (!strcmp(name + length - 4, ".mid") || !strcmp(name + length - 4, ".MID"))) {
+        length -= 4;
+    }
+    if (r->out_dir) {
+        snprintf(path, size, "%s/%.*s.render.mid", r->out_dir, (int)length, name);
+    } else {
+        snprintf(path, size, "%.*s.render.mid", (int)length, name);
+    }
+}
+
+
+static void*
+render_thread(void* arg)
+{
+    Renderer* r = (Renderer*)arg;
+    UridMap* urids = (UridMap*)calloc(1, sizeof(UridMap));
+
+    if (!urids) {
+        __atomic_add_fetch(&r->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    urids->map.handle = urids;
+    urids->map.map = map_uri;
+    urids->map_feature.URI = LV2_URID__map;
+    urids->map_feature.data = &urids->map;
+
+    for (;;) {
+        const uint32_t index = __atomic_fetch_add(&r->next_file, 1, __ATOMIC_RELAXED);
+        if (index >= r->n_files) {
+            break;
+        }
+
+        const char* in_path = r->files[index];
+        char out_path[4096];
+        Smf in, out;
+
+        output_path(r, in_path, out_path, sizeof(out_path));
+
+        const char* error = read_smf(&in, in_path);
+        memset(&out, 0, sizeof(out));
+        if (!error) {
+            error = render(r, urids, &in, &out);
+        }
+        if (!error) {
+            error = write_smf(&out, out_path);
+        }
+
+        if (error) {
+            fprintf(stderr, "%s: %s\n", in_path, error);
+            __atomic_add_fetch(&r->failed, 1, __ATOMIC_RELAXED);
+        } else {
+            printf("%s -> %s\n", in_path, out_path);
+        }
+        free_smf(&in);
+        free_smf(&out);
+    }
+
+    for (uint32_t i = 0; i < urids->n_uris; i++) {
+        free(urids->uris[i]);
+    }
+    free(urids);
+
+    return NULL;
+}
+
+
+// Find a plugin in a binary, which may contain several of them
+static bool
+load_stage(StageConfig* stage, const char* path, const char* uri)
+{
+    void* lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!lib) {
+        fprintf(stderr, "%s\n", dlerror());
+        return false;
+    }
+
+    LV2_Descriptor_Function get_descriptor = (LV2_Descriptor_Function)dlsym(lib, "lv2_descriptor");
+    const LV2_Descriptor* descriptor;
+
+    for (uint32_t d = 0; get_descriptor && (descriptor = get_descriptor(d)); d++) {
+        if (!strcmp(descriptor->URI, uri)) {
+            stage->descriptor = descriptor;
+            return true;
+        }
+    }
+
+    fprintf(stderr, "%s: does not contain %s\n", path, uri);
+    return false;
+}
+
+
+static bool
+set_control(StageConfig* stage, const char* setting)
+{
+    const char* equals = strchr(setting, '=');
+    const PluginInfo* info = stage->info;
+
+    if (!equals) {
+        return false;
+    }
+    for (uint32_t p = 0; p < info->n_ports; p++) {
+        if (info->ports[p].type == PORT_CONTROL
+                && strlen(info->ports[p].symbol) == (size_t)(equals - setting)
+                && !strncmp(info->ports[p].symbol, setting, (size_t)(equals - setting))) {
+            stage->controls[p] = (float)atof(equals + 1);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+static void
+usage(const char* name)
+{
+    fprintf(stderr,
+            "Usage: %s [-A ARPEGGIATOR.so] [-P PATTERN.so] [-a SYMBOL=VALUE]... [-p SYMBOL=VALUE]...\n"
+            "          [-j JOBS] [-r RATE] [-b BLOCKSIZE] [-t SECONDS] [-o DIR] FILE.mid...\n"
+            "  -A  render through the arpeggiator in this plugin binary\n"
+            "  -P  render through midi-pattern in this plugin binary, after the arpeggiator\n"
+            "  -a  set a control port of the arpeggiator by its symbol\n"
+            "  -p  set a control port of midi-pattern by its symbol\n"
+            "  -j  number of files rendered in parallel (default number of CPUs)\n"
+            "  -r  sample rate (default 48000)\n"
+            "  -b  block size (default 256)\n"
+            "  -t  seconds rendered after the last event of the file (default 2)\n"
+            "  -o  directory for the output files (default next to the input)\n"
+            "The output of FILE.mid is written to FILE.render.mid\n", name);
+}
+
+
+int
+main(int argc, char** argv)
+{
+    const char* arp_path = NULL;
+    const char* pattern_path = NULL;
+    const char* arp_settings[MAX_SETTINGS];
+    const char* pattern_settings[MAX_SETTINGS];
+    uint32_t n_arp_settings = 0;
+    uint32_t n_pattern_settings = 0;
+    long n_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    Renderer r;
+    int opt;
+
+    memset(&r, 0, sizeof(r));
+    r.samplerate = 48000.0;
+    r.block_size = 256;
+    r.tail = 2.0;
+
+    while ((opt = getopt(argc, argv, "A:P:a:p:j:r:b:t:o:h")) != -1) {
+        switch (opt)
+        {
+            case 'A':
+                arp_path = optarg;
+                break;
+            case 'P':
+                pattern_path = optarg;
+                break;
+            case 'a':
+                if (n_arp_settings == MAX_SETTINGS) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                arp_settings[n_arp_settings++] = optarg;
+                break;
+            case 'p':
+                if (n_pattern_settings == MAX_SETTINGS) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                pattern_settings[n_pattern_settings++] = optarg;
+                break;
+            case 'j':
+                n_jobs = atol(optarg);
+                break;
+            case 'r':
+                r.samplerate = atof(optarg);
+                break;
+            case 'b':
+                r.block_size = (uint32_t)atol(optarg);
+                break;
+            case 't':
+                r.tail = atof(optarg);
+                break;
+            case 'o':
+                r.out_dir = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc || (!arp_path && !pattern_path) || n_jobs < 1
+            || r.samplerate <= 0 || r.block_size == 0 || r.tail < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char* paths[MAX_STAGES] = { arp_path, pattern_path };
+    const char* const* settings[MAX_STAGES] = { arp_settings, pattern_settings };
+    const uint32_t n_settings[MAX_STAGES] = { n_arp_settings, n_pattern_settings };
+
+    for (uint32_t i = 0; i < MAX_STAGES; i++) {
+        if (!paths[i]) {
+            continue;
+        }
+
+        StageConfig* stage = &r.stages[r.n_stages++];
+        stage->info = &plugins[i];
+        for (uint32_t p = 0; p < stage->info->n_ports; p++) {
+            stage->controls[p] = stage->info->ports[p].value;
+        }
+        if (!load_stage(stage, paths[i], stage->info->uri)) {
+            return 1;
+        }
+        for (uint32_t s = 0; s < n_settings[i]; s++) {
+            if (!set_control(stage, settings[i][s])) {
+                fprintf(stderr, "%s: unknown control setting %s\n", stage->info->name, settings[i][s]);
+                return 1;
+            }
+        }
+    }
+
+    r.files = &argv[optind];
+    r.n_files = (uint32_t)(argc - optind);
+    n_jobs = (n_jobs > (long)r.n_files) ? (long)r.n_files : n_jobs;
+
+    pthread_t* threads = (pthread_t*)calloc((size_t)n_jobs, sizeof(pthread_t));
+    long n_threads = 0;
+
+    for (; threads && n_threads < n_jobs; n_threads++) {
+        if (pthread_create(&threads[n_threads], NULL, render_thread, &r) != 0) {
+            break;
+        }
+    }
+    if (n_threads == 0) {
+        // Render on this thread when no thread could be started
+        render_thread(&r);
+    }
+    for (long t = 0; t < n_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+
+    return (r.failed > 0) ? 1 : 0;
+}